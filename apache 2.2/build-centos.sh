@@ -1,12 +1,13 @@
 # MOD_CSRFPROTECTOR  - Apache 2.2.x module for mitigating CSRF vulnerabilities
 #                        In web applications
-# Required packages: httpd-devel gcc gcc-c++ make openssl-devel
+# Required packages: httpd-devel gcc gcc-c++ make openssl-devel zlib-devel
 clear
 APACHE_VER=2.2.2
 echo "Building for apache version $APACHE_VER"
 echo "BUILD INIT...."
 echo "Initiating MOD_CSRFPROTECTOR BUILD PROCESS"
-sudo apxs -cia -n csrf_protector ./src/mod_csrfprotector.c ./src/sqlite/sqlite3.c -lssl -lcrypto
+sudo apxs -cia -n csrf_protector ./src/mod_csrfprotector.c ./src/csrfp_store.c ./src/sqlite/sqlite3.c -lssl -lcrypto -lz
+gcc -O2 -o ./build/csrfp_tool ./src/csrfp_tool.c ./src/csrfp_store.c ./src/sqlite/sqlite3.c -lpthread -ldl
 echo "BUILD FINISHED ...!"
 echo "Restarting APACHE ...!"
 
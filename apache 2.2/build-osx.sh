@@ -6,7 +6,8 @@ APACHE_VER=2.2.2
 echo "Building for apache version $APACHE_VER in OS X"
 echo "BUILD INIT...."
 echo "Initiating MOD_CSRFPROTECTOR BUILD PROCESS"
-sudo apxs -cia -n csrf_protector ./src/mod_csrfprotector.c ./src/sqlite/sqlite3.c -lssl -lcrypto
+sudo apxs -cia -n csrf_protector ./src/mod_csrfprotector.c ./src/csrfp_store.c ./src/sqlite/sqlite3.c -lssl -lcrypto -lz
+gcc -O2 -o ./build/csrfp_tool ./src/csrfp_tool.c ./src/csrfp_store.c ./src/sqlite/sqlite3.c -lpthread -ldl
 echo "BUILD FINISHED ...!"
 echo "Restarting APACHE ...!"
 
@@ -9,7 +9,8 @@ jsFileName=csrfprotector.js
 echo "Building for apache version $APACHE_VER"
 echo "BUILD INIT...."
 echo "Initiating MOD_CSRFPROTECTOR BUILD PROCESS"
-sudo apxs2 -cia -n csrf_protector ./src/mod_csrfprotector.c ./src/sqlite/sqlite3.c -lssl -lcrypto
+sudo apxs2 -cia -n csrf_protector ./src/mod_csrfprotector.c ./src/csrfp_store.c ./src/sqlite/sqlite3.c -lssl -lcrypto -lz
+gcc -O2 -o ./build/csrfp_tool ./src/csrfp_tool.c ./src/csrfp_store.c ./src/sqlite/sqlite3.c -lpthread -ldl
 echo "BUILD FINISHED ...!"
 
 echo "---------------------------------------------------"
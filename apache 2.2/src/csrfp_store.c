@@ -0,0 +1,177 @@
+/**
+ * Copyright 2014 OWASP Foundation
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ *  * distributed under the License is distributed on an "AS IS" BASIS,
+ *  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  * See the License for the specific language governing permissions and
+ * limitations under the License. 
+ * 
+ * Token store schema and storage functions shared by mod_csrfprotector
+ * and the csrfp_tool maintenance utility.
+*/ 
+
+/** standard c libs **/
+#include "stddef.h"
+
+#include "csrfp_store.h"
+
+/*
+ * Function: csrfp_store_schema
+ * Function to create the CSRFP tables if they do not exist yet
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * tokenLength - length of the token column
+ * zErrMsg - set to an sqlite3_malloc'ed error message on failure
+ *
+ * Returns: 
+ * integer, SQLITE_OK on success
+ */
+int csrfp_store_schema(sqlite3 *db, int tokenLength, char **zErrMsg)
+{
+    //#todo: make sessid, token length configurable. also timestamp length
+    // & compile this sql string based on those values here
+    char *sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS CSRFP("  \
+         "sessid char(%d) PRIMARY KEY NOT NULL," \
+         "token char(%d) NOT NULL,"\
+         "timestamp int NOT NULL );"\
+         "CREATE TABLE IF NOT EXISTS CSRFP_COUNTER (" \
+         "counter int NOT NULL );", SQL_SESSID_COLUMN_LENGTH, tokenLength);
+    if (sql == NULL) {
+        return SQLITE_NOMEM;
+    }
+
+    /* Execute SQL statement */
+    int rc = sqlite3_exec(db, sql, 0, 0, zErrMsg);
+    sqlite3_free(sql);
+    return rc;
+}
+
+/*
+ * Function: csrfp_store_expire
+ * Function to delete sessions whose token was issued before a time
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * before - unix time, older rows are deleted
+ * zErrMsg - set to an sqlite3_malloc'ed error message on failure
+ *
+ * Returns: 
+ * integer, SQLITE_OK on success
+ */
+int csrfp_store_expire(sqlite3 *db, sqlite3_int64 before, char **zErrMsg)
+{
+    char *sql = sqlite3_mprintf("DELETE FROM CSRFP WHERE timestamp < %lld", before);
+    if (sql == NULL) {
+        return SQLITE_NOMEM;
+    }
+
+    int rc = sqlite3_exec(db, sql, 0, 0, zErrMsg);
+    sqlite3_free(sql);
+    return rc;
+}
+
+/*
+ * Function: csrfp_store_match
+ * Function to look up a session holding a given token
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * sessid - session id
+ * token - token to match
+ * timestamp - set to the time the token was issued, on a match
+ *
+ * Returns: 
+ * integer, SQLITE_ROW on a match, SQLITE_DONE if none, an error code otherwise
+ */
+int csrfp_store_match(sqlite3 *db, const char *sessid, const char *token,
+                        sqlite3_int64 *timestamp)
+{
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, "SELECT timestamp FROM CSRFP"
+                                " WHERE sessid = ? AND token = ?", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    // Both come from the client, they are bound and never part of the sql
+    sqlite3_bind_text(stmt, 1, sessid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, token, -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        *timestamp = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+/*
+ * Function: csrfp_store_token
+ * Function to get the token of a session
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * sessid - session id
+ * token - set to an sqlite3_malloc'ed copy of the token, if found
+ *
+ * Returns: 
+ * integer, SQLITE_ROW if found, SQLITE_DONE if none, an error code otherwise
+ */
+int csrfp_store_token(sqlite3 *db, const char *sessid, char **token)
+{
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, "SELECT token FROM CSRFP WHERE sessid = ?",
+                                -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    sqlite3_bind_text(stmt, 1, sessid, -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        *token = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(stmt, 0));
+        if (*token == NULL) {
+            rc = SQLITE_NOMEM;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+/*
+ * Function: csrfp_store_put
+ * Function to add a session, or replace the token of an existing one
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * sessid - session id
+ * token - token of the session
+ * timestamp - unix time the token was issued
+ *
+ * Returns: 
+ * integer, SQLITE_OK on success
+ */
+int csrfp_store_put(sqlite3 *db, const char *sessid, const char *token,
+                    sqlite3_int64 timestamp)
+{
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO CSRFP (sessid, token, timestamp)"
+                                " VALUES (?, ?, ?)", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    sqlite3_bind_text(stmt, 1, sessid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, token, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, timestamp);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
@@ -0,0 +1,107 @@
+/**
+ * Copyright 2014 OWASP Foundation
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ *  * distributed under the License is distributed on an "AS IS" BASIS,
+ *  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  * See the License for the specific language governing permissions and
+ * limitations under the License. 
+ * 
+ * Token store schema and storage functions shared by mod_csrfprotector
+ * and the csrfp_tool maintenance utility. No Apache dependencies.
+*/ 
+
+#ifndef CSRFP_STORE_H
+#define CSRFP_STORE_H
+
+/** SQLite library **/
+#include "sqlite/sqlite3.h"
+
+/** definations **/
+#define DATABASE_DEFAULT_LOCATION "/tmp/csrfp.db"
+
+#define SQL_SESSID_DEFAULT_LENGTH 10
+#define SQL_SESSID_COLUMN_LENGTH 20
+#define TOKEN_EXPIRY_MAXTIME 1800
+
+/*
+ * Function: csrfp_store_schema
+ * Function to create the CSRFP tables if they do not exist yet
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * tokenLength - length of the token column
+ * zErrMsg - set to an sqlite3_malloc'ed error message on failure
+ *
+ * Returns: 
+ * integer, SQLITE_OK on success
+ */
+int csrfp_store_schema(sqlite3 *db, int tokenLength, char **zErrMsg);
+
+/*
+ * Function: csrfp_store_expire
+ * Function to delete sessions whose token was issued before a time
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * before - unix time, older rows are deleted
+ * zErrMsg - set to an sqlite3_malloc'ed error message on failure
+ *
+ * Returns: 
+ * integer, SQLITE_OK on success
+ */
+int csrfp_store_expire(sqlite3 *db, sqlite3_int64 before, char **zErrMsg);
+
+/*
+ * Function: csrfp_store_match
+ * Function to look up a session holding a given token
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * sessid - session id
+ * token - token to match
+ * timestamp - set to the time the token was issued, on a match
+ *
+ * Returns: 
+ * integer, SQLITE_ROW on a match, SQLITE_DONE if none, an error code otherwise
+ */
+int csrfp_store_match(sqlite3 *db, const char *sessid, const char *token,
+                        sqlite3_int64 *timestamp);
+
+/*
+ * Function: csrfp_store_token
+ * Function to get the token of a session
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * sessid - session id
+ * token - set to an sqlite3_malloc'ed copy of the token, if found
+ *
+ * Returns: 
+ * integer, SQLITE_ROW if found, SQLITE_DONE if none, an error code otherwise
+ */
+int csrfp_store_token(sqlite3 *db, const char *sessid, char **token);
+
+/*
+ * Function: csrfp_store_put
+ * Function to add a session, or replace the token of an existing one
+ *
+ * Parameters: 
+ * db - sqlite database object
+ * sessid - session id
+ * token - token of the session
+ * timestamp - unix time the token was issued
+ *
+ * Returns: 
+ * integer, SQLITE_OK on success
+ */
+int csrfp_store_put(sqlite3 *db, const char *sessid, const char *token,
+                    sqlite3_int64 timestamp);
+
+#endif
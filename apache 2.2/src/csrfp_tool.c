@@ -0,0 +1,420 @@
+/**
+ * Copyright 2014 OWASP Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ *  * distributed under the License is distributed on an "AS IS" BASIS,
+ *  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Source code of csrfp_tool, offline maintenance utility for the
+ * mod_csrfprotector token store. Safe to run against a live database,
+ * SQLite locking serialises it with the apache children.
+*/
+
+/** standard c libs **/
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+
+/** token store schema **/
+#include "csrfp_store.h"
+
+/** definations **/
+#define CSRFP_TOOL_BUSY_TIMEOUT 5000        // ms to wait for a live server's lock
+#define CSRFP_TOOL_LINE_MAXLENGTH 512       // max length of an import line
+
+/*
+ * Variable: csrfp_age_buckets
+ * upper bounds (seconds) of the age histogram reported by stats
+ */
+static const struct {
+    const char *label;
+    int maxAge;
+} csrfp_age_buckets[] = {
+    {"< 1m", 60},
+    {"1m - 5m", 300},
+    {"5m - 15m", 900},
+    {"15m - 30m", TOKEN_EXPIRY_MAXTIME},
+    {"expired", 0}                          // everything older
+};
+
+#define CSRFP_AGE_BUCKETS (sizeof(csrfp_age_buckets) / sizeof(csrfp_age_buckets[0]))
+
+//=============================================================
+// Utility functions
+//=============================================================
+
+/*
+ * Function: usage
+ * Prints command line help
+ *
+ * Parameters:
+ * prog - name the tool was invoked as
+ *
+ * Returns:
+ * integer, exit code
+ */
+static int usage(const char *prog)
+{
+    fprintf(stderr,
+        "Usage: %s [-d database] command [args]\n"
+        "\n"
+        "Commands:\n"
+        "  stats                 row count, token age distribution, page usage\n"
+        "  expire [seconds]      delete sessions older than seconds (default %d)\n"
+        "  vacuum                rebuild the file, returning free pages\n"
+        "  export [file]         write sessions as sessid<TAB>token<TAB>timestamp\n"
+        "  import [file]         insert or replace sessions written by export\n"
+        "\n"
+        "Default database is %s, file '-' or none means stdin/stdout.\n",
+        prog, TOKEN_EXPIRY_MAXTIME, DATABASE_DEFAULT_LOCATION);
+    return 2;
+}
+
+/*
+ * Function: pragma_int
+ * Returns the integer value of a PRAGMA, -1 on error
+ *
+ * Parameters:
+ * db - sqlite database object
+ * name - pragma name
+ *
+ * Returns:
+ * sqlite3_int64, value of pragma
+ */
+static sqlite3_int64 pragma_int(sqlite3 *db, const char *name)
+{
+    sqlite3_stmt *stmt;
+    sqlite3_int64 value = -1;
+    char *sql = sqlite3_mprintf("PRAGMA %s", name);
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            value = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_free(sql);
+    return value;
+}
+
+/*
+ * Function: sql_error
+ * Prints the last error of db
+ *
+ * Parameters:
+ * db - sqlite database object
+ * what - operation which failed
+ *
+ * Returns:
+ * integer, exit code
+ */
+static int sql_error(sqlite3 *db, const char *what)
+{
+    fprintf(stderr, "csrfp_tool: %s: %s\n", what, sqlite3_errmsg(db));
+    return 1;
+}
+
+//=============================================================
+// Commands
+//=============================================================
+
+/*
+ * Function: cmd_stats
+ * Reports row count, age distribution of tokens and page fragmentation
+ *
+ * Parameters:
+ * db - sqlite database object
+ *
+ * Returns:
+ * integer, exit code
+ */
+static int cmd_stats(sqlite3 *db)
+{
+    sqlite3_int64 counts[CSRFP_AGE_BUCKETS] = {0};
+    sqlite3_int64 total = 0;
+    sqlite3_int64 now = (sqlite3_int64)time(NULL);
+    sqlite3_stmt *stmt;
+    unsigned int i;
+    int rc;
+
+    rc = sqlite3_prepare_v2(db, "SELECT timestamp FROM CSRFP", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return sql_error(db, "stats");
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        sqlite3_int64 age = now - sqlite3_column_int64(stmt, 0);
+        for (i = 0; i < CSRFP_AGE_BUCKETS - 1; i++) {
+            if (age < csrfp_age_buckets[i].maxAge) break;
+        }
+        counts[i]++;
+        total++;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        return sql_error(db, "stats");
+    }
+
+    printf("rows: %lld\n", total);
+    printf("age:\n");
+    for (i = 0; i < CSRFP_AGE_BUCKETS; i++) {
+        printf("  %-10s %lld\n", csrfp_age_buckets[i].label, counts[i]);
+    }
+
+    sqlite3_int64 pageSize = pragma_int(db, "page_size");
+    sqlite3_int64 pageCount = pragma_int(db, "page_count");
+    sqlite3_int64 freePages = pragma_int(db, "freelist_count");
+
+    printf("pages:\n");
+    printf("  page_size  %lld\n", pageSize);
+    printf("  page_count %lld (%lld bytes)\n", pageCount, pageCount * pageSize);
+    printf("  free       %lld (%.1f%%)\n", freePages,
+        pageCount > 0 ? 100.0 * freePages / pageCount : 0.0);
+    return 0;
+}
+
+/*
+ * Function: cmd_expire
+ * Deletes sessions older than maxAge seconds
+ *
+ * Parameters:
+ * db - sqlite database object
+ * maxAge - age in seconds
+ *
+ * Returns:
+ * integer, exit code
+ */
+static int cmd_expire(sqlite3 *db, long maxAge)
+{
+    char *zErrMsg = NULL;
+    int rc = csrfp_store_expire(db, (sqlite3_int64)time(NULL) - maxAge, &zErrMsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "csrfp_tool: expire: %s\n", zErrMsg);
+        sqlite3_free(zErrMsg);
+        return 1;
+    }
+
+    printf("expired: %d\n", sqlite3_changes(db));
+    return 0;
+}
+
+/*
+ * Function: cmd_vacuum
+ * Rebuilds the database file, dropping free pages
+ *
+ * Parameters:
+ * db - sqlite database object
+ *
+ * Returns:
+ * integer, exit code
+ */
+static int cmd_vacuum(sqlite3 *db)
+{
+    sqlite3_int64 before = pragma_int(db, "page_count");
+    if (sqlite3_exec(db, "VACUUM", 0, 0, NULL) != SQLITE_OK) {
+        return sql_error(db, "vacuum");
+    }
+
+    printf("pages: %lld -> %lld\n", before, pragma_int(db, "page_count"));
+    return 0;
+}
+
+/*
+ * Function: cmd_export
+ * Writes all sessions, one per line, as sessid<TAB>token<TAB>timestamp
+ *
+ * Parameters:
+ * db - sqlite database object
+ * out - output stream
+ *
+ * Returns:
+ * integer, exit code
+ */
+static int cmd_export(sqlite3 *db, FILE *out)
+{
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, "SELECT sessid, token, timestamp FROM CSRFP",
+                                -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        return sql_error(db, "export");
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        fprintf(out, "%s\t%s\t%lld\n",
+            (const char *)sqlite3_column_text(stmt, 0),
+            (const char *)sqlite3_column_text(stmt, 1),
+            sqlite3_column_int64(stmt, 2));
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        return sql_error(db, "export");
+    }
+    return 0;
+}
+
+/*
+ * Function: cmd_import
+ * Inserts or replaces sessions written by cmd_export, in one transaction
+ *
+ * Parameters:
+ * db - sqlite database object
+ * in - input stream
+ *
+ * Returns:
+ * integer, exit code
+ */
+static int cmd_import(sqlite3 *db, FILE *in)
+{
+    char line[CSRFP_TOOL_LINE_MAXLENGTH];
+    sqlite3_stmt *stmt;
+    int lineNo = 0, imported = 0;
+
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, NULL) != SQLITE_OK) {
+        return sql_error(db, "import");
+    }
+
+    if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO CSRFP (sessid, token, timestamp)"
+                           " VALUES (?, ?, ?)", -1, &stmt, NULL) != SQLITE_OK) {
+        sql_error(db, "import");
+        sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), in)) {
+        char *sessid, *token, *timestamp, *end;
+        lineNo++;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+
+        sessid = line;
+        token = strchr(sessid, '\t');
+        timestamp = token ? strchr(token + 1, '\t') : NULL;
+        if (!timestamp) {
+            fprintf(stderr, "csrfp_tool: import: malformed line %d\n", lineNo);
+            goto failed;
+        }
+        *token++ = '\0';
+        *timestamp++ = '\0';
+
+        sqlite3_int64 ts = strtoll(timestamp, &end, 10);
+        if (*end != '\0' || end == timestamp) {
+            fprintf(stderr, "csrfp_tool: import: bad timestamp on line %d\n", lineNo);
+            goto failed;
+        }
+
+        sqlite3_bind_text(stmt, 1, sessid, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, token, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 3, ts);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            sql_error(db, "import");
+            goto failed;
+        }
+        sqlite3_reset(stmt);
+        imported++;
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_exec(db, "COMMIT", 0, 0, NULL) != SQLITE_OK) {
+        sql_error(db, "import");
+        sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+        return 1;
+    }
+
+    printf("imported: %d\n", imported);
+    return 0;
+
+    failed:
+    sqlite3_finalize(stmt);
+    sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+    return 1;
+}
+
+//=============================================================
+// Main
+//=============================================================
+
+int main(int argc, char **argv)
+{
+    const char *prog = argv[0];
+    const char *path = DATABASE_DEFAULT_LOCATION;
+    const char *command;
+    const char *arg = NULL;
+    sqlite3 *db;
+    char *zErrMsg = NULL;
+    int i = 1, rc;
+
+    if (i + 1 < argc && !strcmp(argv[i], "-d")) {
+        path = argv[i + 1];
+        i += 2;
+    }
+    if (i >= argc) {
+        return usage(prog);
+    }
+    command = argv[i++];
+    if (i < argc) {
+        arg = argv[i++];
+    }
+    if (i < argc) {
+        return usage(prog);
+    }
+
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        rc = sql_error(db, path);
+        sqlite3_close(db);
+        return rc;
+    }
+    sqlite3_busy_timeout(db, CSRFP_TOOL_BUSY_TIMEOUT);
+
+    // A database the module never opened yet still gets a schema, column
+    // width of token is fixed by whoever creates the table first
+    if (csrfp_store_schema(db, 0, &zErrMsg) != SQLITE_OK) {
+        fprintf(stderr, "csrfp_tool: %s: %s\n", path, zErrMsg);
+        sqlite3_free(zErrMsg);
+        sqlite3_close(db);
+        return 1;
+    }
+
+    if (!strcmp(command, "stats") && !arg) {
+        rc = cmd_stats(db);
+    } else if (!strcmp(command, "expire")) {
+        char *end = NULL;
+        long maxAge = arg ? strtol(arg, &end, 10) : TOKEN_EXPIRY_MAXTIME;
+        if ((arg && (*end != '\0' || end == arg)) || maxAge < 0) {
+            rc = usage(prog);
+        } else {
+            rc = cmd_expire(db, maxAge);
+        }
+    } else if (!strcmp(command, "vacuum") && !arg) {
+        rc = cmd_vacuum(db);
+    } else if (!strcmp(command, "export") || !strcmp(command, "import")) {
+        int export = !strcmp(command, "export");
+        FILE *f = export ? stdout : stdin;
+        if (arg && strcmp(arg, "-")) {
+            f = fopen(arg, export ? "w" : "r");
+            if (!f) {
+                perror(arg);
+                sqlite3_close(db);
+                return 1;
+            }
+        }
+        rc = export ? cmd_export(db, f) : cmd_import(db, f);
+        if (f != stdout && f != stdin) {
+            fclose(f);
+        }
+    } else {
+        rc = usage(prog);
+    }
+
+    sqlite3_close(db);
+    return rc;
+}
@@ -21,11 +21,15 @@
 #include "stdio.h"
 #include "stdlib.h"
 #include "time.h"
+#include "unistd.h"
 
 /** openSSL **/
 #include "openssl/rand.h"
 #include "openssl/sha.h"
 
+/** zlib, pre-compressed copy of the served js **/
+#include "zlib.h"
+
 /** apache **/
 #include "ap_config.h"
 #include "ap_provider.h"
@@ -37,6 +41,10 @@
 #include "http_request.h"
 #include "util_filter.h"
 #include "ap_regex.h"
+#include "ap_mpm.h"
+#ifdef AP_NEED_SET_MUTEX_PERMS
+#include "unixd.h"
+#endif
 
 /** APRs **/
 #include "apr_hash.h"
@@ -44,9 +52,23 @@
 #include "apr_buckets.h"
 #include "apr_lib.h"
 #include "apr_strings.h"
-
-/** SQLite library **/
+#include "apr_atomic.h"
+#include "apr_time.h"
+#include "apr_shm.h"
+#include "apr_global_mutex.h"
+#include "apr_file_io.h"
+#include "apr_mmap.h"
+#include "apr_sha1.h"
+
+/** SIMD intrinsics, paths picked at runtime by csrfp_find_init() **/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CSRFP_X86_SIMD 1
+#include "immintrin.h"
+#endif
+
+/** SQLite library & token store schema **/
 #include "sqlite/sqlite3.h"
+#include "csrfp_store.h"
 
 /** definations **/
 #define CSRFP_NAME_VERSION "CSRFP 0.0.1"
@@ -57,8 +79,19 @@
 #define DEFAULT_POST_ENCTYPE "application/x-www-form-urlencoded"
 #define CSRFP_REGEN_TOKEN "true"
 #define CSRFP_CHUNKED_ONLY 0
-#define CSRFP_OVERLAP_BUCKET_SIZE 8
-#define CSRFP_OVERLAP_BUCKET_DEFAULT "--------"
+#define CSRFP_LENGTH_HOLD_MAX 65536         // bytes held back to keep an exact Content-Length
+#define DEFAULT_SCAN_LIMIT 0                // bytes scanned per response, 0 - no limit
+#define CSRFP_SCAN_CHUNK_SIZE 8192          // bytes of a file bucket read per scan step
+#define CSRFP_GZIP_CHUNK_SIZE 8192          // bytes (de)compressed per step of gzip responses
+#define CSRFP_MARKER_MAXLENGTH 8         // longest of csrfp_markers, and then some
+#define CSRFP_MARKERS_MAX 4                 // markers searched at the same time
+#define CSRFP_TAG_MAXLENGTH 1024            // longest <form>/<a> tag rewritten
+#define CSRFP_REWRITE_FORMS 1               // csrfp_opf_ctx.rewrite, token in same origin forms
+#define CSRFP_REWRITE_LINKS 2               // csrfp_opf_ctx.rewrite, token in verifyGetFor links
+#define CSRFP_PREFIX_MAXLENGTH 256          // longest literal prefix indexed per rule
+#define CSRFP_PREFIX_ACTIVE_MAX 32          // trie nodes followed at once by csrfp_prefix_match
+#define CSRFP_MARKER_NONE -1                // csrfp_marker_match, no marker
+#define CSRFP_MARKER_PREFIX -2              // csrfp_marker_match, need more data
 
 #define CSRFP_URI_MAXLENGTH 512
 #define CSRFP_ERROR_MESSAGE_MAXLENGTH 1024
@@ -71,19 +104,60 @@
 #define DEFAULT_ERROR_MESSAGE "<h2>ACCESS FORBIDDEN BY OWASP CSRF_PROTECTOR!</h2>"
 #define DEFAULT_REDIRECT_URL ""
 #define DEFAULT_JS_FILE_PATH "http://localhost/csrfp_js/csrfprotector.js"
+#define CSRFP_JS_URI_PREFIX "/csrfp_js/csrfprotector."  // csrfpJsFile served at...
+#define CSRFP_JS_URI_SUFFIX ".js"           // ... prefix<hash of the content>suffix
+#define CSRFP_JS_HASH_LENGTH 8              // bytes of the SHA1 of the js in its url
+#define CSRFP_JS_MAX_SIZE (1024 * 1024)     // largest csrfpJsFile loaded
 #define DEFAULT_DISABLED_JS_MESSSAGE "This site attempts to protect users against" \
 " <a href=\"https://www.owasp.org/index.php/Cross-Site_Request_Forgery_%28CSRF%29\">" \
 " Cross-Site Request Forgeries </a> attacks. In order to do so, you must have JavaScript " \
 " enabled in your web browser otherwise this site will fail to work correctly for you. " \
 " See details of your web browser for how to enable JavaScript."
 
-#define CSRFP_IGNORE_PATTERN ".*(jpg)|(jpeg)|(gif)|(png)|(js)|(css)|(xml)|(xsl)|(json)|(txt)|(csv)$"
-#define CSRFP_IGNORE_TEXT "csrfp_ignore_set"
-
-#define SQL_SESSID_DEFAULT_LENGTH 10
-#define TOKEN_EXPIRY_MAXTIME 1800
-
-#define DATABASE_DEFAULT_LOCATION "/tmp/csrfp.db"
+#define DEFAULT_IGNORE_EXTENSIONS "jpg jpeg gif png js css xml xsl json txt csv"
+#define CSRFP_UNSET -1                      // int config value not set in this server
+#define CSRFP_EXTENSION_MAXLENGTH 16        // longest extension looked up in ignoreExt
+#define CSRFP_VALIDATION_UNKNOWN 0          // csrfp_opf_ctx.validation, not decided yet
+#define CSRFP_VALIDATION_NO 1               // csrfp_opf_ctx.validation, request is ignored
+#define CSRFP_VALIDATION_YES 2              // csrfp_opf_ctx.validation, request is checked
+#define CSRFP_ETAG_SUFFIX "-csrfp"          // ETag of injected pages, W/"<etag>-csrfp<hash>"
+#define CSRFP_ETAG_HASH_LENGTH 4            // bytes of the fragments' SHA1 in the ETag
+#define CSRFP_ETAG_NOTE "csrfp_etag"        // note, If-None-Match had a derived ETag
+#define CSRFP_CHECKED_NOTE "csrfp_checked"  // note, csrfp_header_parser ran for the request
+#define CSRFP_VALIDATED_NOTE "csrfp_validated" // note, the request's token passed the check
+#define CSRFP_TOKEN_FILTER_NOTE "csrfp_token_filter"    // note, token filter added
+#define CSRFP_TOKEN_NOTE "csrfp_token_value"    // note, token set as cookie for the request
+
+#define DEFAULT_STORE_TIMEOUT 250           // ms of token store time per request
+#define DEFAULT_STORE_FAIL_THRESHOLD 5      // consecutive failures to trip breaker
+#define DEFAULT_STORE_RETRY_AFTER 30        // seconds the breaker stays open
+#define CSRFP_STORE_PROGRESS_OPS 1000       // VM steps between deadline checks
+#define CSRFP_STORE_BUDGET_KEY "csrfp_store_budget"
+
+#define CSRFP_SQL_PAGE_SIZE 1024            // page size of the CSRFP database
+#define CSRFP_SQL_PAGECACHE_SLOT (CSRFP_SQL_PAGE_SIZE + 256)   // page + header
+#define CSRFP_SQL_PAGECACHE_SLOTS 64        // pages in the preallocated arena
+#define CSRFP_SQL_LOOKASIDE_SLOT 256        // bytes per lookaside slot
+#define CSRFP_SQL_LOOKASIDE_SLOTS 64        // lookaside slots per connection
+
+#define CSRFP_SHM_VFS_NAME "csrfp-shm"
+#define CSRFP_SHM_DB_NAME "csrfp-shm.db"      // name of database in shm VFS
+#define CSRFP_SHM_JOURNAL_NAME "csrfp-shm.db-journal"   // its rollback journal
+#define CSRFP_SHM_MAGIC 0x43535246          // "CSRF"
+#define DEFAULT_STORE_SHM_SIZE 4096         // KB of shared memory for the store
+
+// Lock of the shm store, the kernel drops it when its holder dies
+#if APR_HAS_FCNTL_SERIALIZE
+#define CSRFP_SHM_LOCK_MECH APR_LOCK_FCNTL
+#elif APR_HAS_FLOCK_SERIALIZE
+#define CSRFP_SHM_LOCK_MECH APR_LOCK_FLOCK
+#else
+#define CSRFP_SHM_LOCK_MECH APR_LOCK_DEFAULT
+#endif
+
+#define CSRFP_SNAPSHOT_MAGIC "CSRFPSN1"     // 8 bytes, format version included
+#define CSRFP_SNAPSHOT_TIMEOUT 2000         // ms to wait for children's locks
+#define CSRFP_POST_CONFIG_KEY "csrfp_post_config"
 
 #define RESEED_RAND_AT 10000
 
@@ -96,6 +170,7 @@
  */
 typedef enum
 {
+    CSRFP_FLAG_UNSET = -1,              // Not set in this server or scope
     CSRFP_TRUE,
     CSRFP_FALSE                         // Added CSRFP_ prefix to preven enum redeclaration error in OS X
 } Flag;                                 // Flag enum for stating weather to use...
@@ -107,6 +182,7 @@ typedef enum
  */
 typedef enum
 {
+    action_unset = -1,                  // Not set in this server
     forbidden,
     strip,
     redirect,
@@ -114,6 +190,28 @@ typedef enum
     internal_server_error
 } csrfp_actions;                        // Action enum listing all actions
 
+/*
+ * Variable: csrfp_store_actions
+ * enumerator - lists the actions to be taken when token store is unavailable
+ */
+typedef enum
+{
+    store_action_unset = -1,            // Not set in this server
+    store_reject,                       // Refuse the request (503)
+    store_accept,                       // Accept the request, log the event
+    store_stateless                     // Compare token against the token cookie
+} csrfp_store_actions;                  // Degradation enum for token store
+
+/*
+ * Variable: csrfp_store_backends
+ * enumerator - lists where the token database is kept
+ */
+typedef enum
+{
+    store_file,                         // SQLite file at DATABASE_DEFAULT_LOCATION
+    store_shm                           // SQLite pages in a shared memory segment
+} csrfp_store_backends;                 // Token store backend enum
+
 /*
  * Variable: Filter_Statae
  * enumerator - lists the state through which the output filter goes
@@ -121,11 +219,49 @@ typedef enum
 typedef enum
 {
     op_init,                            // States output filter has initiated
+    op_head_init,                       // States <head was found, <script inserted
     op_body_init,                       // States <body was found, <noscript inserted
     op_body_end,                        // States </body> found, <script inserted
     op_end                              // States output fiter task has finished
 } Filter_State;                         // enum of output filter states
 
+/*
+ * Variable: csrfp_inject_modes
+ * enumerator - lists where the protector script is injected
+ */
+typedef enum
+{
+    inject_unset = -1,                  // Not set in this server
+    inject_body,                        // <noscript> after <body>, <script> after </body>
+    inject_head                         // deferred <script> after <head>, <noscript>...
+                                        // ... after <body>, rest is not scanned
+} csrfp_inject_modes;                   // Injection mode enum
+
+/*
+ * Variable: Marker
+ * enumerator - tags the output filter looks for, see csrfp_markers
+ */
+typedef enum
+{
+    marker_head,                        // <head
+    marker_body,                        // <body
+    marker_body_end,                    // </body
+    marker_form,                        // <form, csrfpRewriteForms
+    marker_a                            // <a, csrfpRewriteForms
+} Marker;                               // enum of tag markers
+
+/*
+ * Variable: Scan_State
+ * enumerator - lists the state of the marker matcher, kept between
+ * buckets so a tag split over buckets is still found
+ */
+typedef enum
+{
+    scan_marker,                        // Searching the markers, see csrfp_opf_ctx.pending
+    scan_boundary,                      // Marker matched, next byte must end the tag name
+    scan_tag_end                        // Inside the marker's tag, searching '>'
+} Scan_State;                           // enum of marker matcher states
+
 /*
  * Variable: Filter_Cookie_Length_State
  * enumerator - lists the state of token cookie
@@ -142,8 +278,6 @@ typedef enum
  */
 typedef struct
 {
-    Flag flag;                          // Flag to check if CSRFP is disabled...
-                                        // ... true by default
     csrfp_actions action;               // Action Codes, Default - forbidden
     char *errorRedirectionUri;          // Uri to redirect in case action == redirect
     char *errorCustomMessage;           // Message to show in case action == message
@@ -151,41 +285,273 @@ typedef struct
     int tokenLength;                    // Length of CSRFP_TOKEN, Default 20
     char *tokenName;                    // Name of the CSRFP token
     char *disablesJsMessage;            // Message to be shown in <noscript>
-    ap_regex_t *ignore_pattern;         // Path pattern for which validation...
-                                        // ...is Not needed
+    int storeTimeout;                   // Token store time budget per request (ms)...
+                                        // ... 0 for no limit
+    int storeFailThreshold;             // Consecutive store failures tripping the breaker
+    int storeRetryAfter;                // Seconds before a tripped breaker is retried
+    csrfp_store_actions storeFailAction;// Action when the token store is unavailable
+    csrfp_store_backends storeBackend;  // Where the token database is kept
+    apr_size_t storeShmSize;            // Size of shared memory segment, bytes
+    const char *snapshotFile;           // Token snapshot kept across restarts...
+                                        // ... NULL for none
+    csrfp_inject_modes injectMode;      // Where the script is injected
+    apr_off_t scanLimit;                // Max bytes of a response scanned, 0 - no limit
+    const char *script;                 // <script> fragment, built at post config
+    apr_size_t scriptLen;               // Length of script
+    const char *noscript;               // <noscript> fragment, built at post config
+    apr_size_t noscriptLen;             // Length of noscript
+    const char *etagSuffix;             // -csrfp<hash of the fragments>", ending...
+                                        // ... the derived ETag of injected pages
+    const char *tokenEndpoint;          // Path the script gets its token cookies from...
+                                        // ... NULL to set them on every page
+    const char *jsFile;                 // csrfprotector.js served by the module, NULL...
+                                        // ... to leave it to jsFilePath
+    const char *js;                     // Minified content of jsFile, loaded at post config
+    apr_size_t jsLen;                   // Length of js
+    const char *jsGz;                   // js, gzip encoded
+    apr_size_t jsGzLen;                 // Length of jsGz
+    const char *jsUri;                  // Versioned url js is served at, NULL if not loaded
+    const char *jsLink;                 // Link: header preloading jsUri
+    Flag rewriteForms;                  // Put the token in forms and links of pages
+    int scoped;                         // 1 if csrfpEnable or ignore rules are set in...
+                                        // ... a <Directory> or <Location> of the server
+    struct csrfp_rule_set *allRules;    // verifyGetFor rules of every scope of the...
+                                        // ... server, for the script and links
 } csrfp_config;                         // CSRFP configuraion
 
+/*
+ * Variable: csrfp_store_budget
+ * structure - token store time accounting for one request
+ */
+typedef struct
+{
+    apr_time_t remaining;               // Store time left for this request
+    apr_time_t opened;                  // Time current store session was opened
+    apr_time_t deadline;                // Deadline of current store session
+    int timedout;                       // Set when an operation hit the deadline
+    int failed;                         // Set when a statement of the current...
+                                        // ... store session returned an error
+} csrfp_store_budget;
+
 /*
  * Variable: csrfp_opf_ctx
  * structure - structure of the csrfp output filter configuration
  */
 typedef struct
 {
-    char *search;                       // Stores the item being serched (regex) 
+    Marker search[CSRFP_MARKERS_MAX];   // Markers being searched, injection ones first
+    int nsearch;                        // Number of markers in search, 0 once...
+                                        // ... nothing is left to search
+    int ninject;                        // Number of injection markers in search
+    int rewrite;                        // CSRFP_REWRITE_* of this response
+    Marker matched;                     // Marker found by the matcher
+    Scan_State scan;                    // State of the marker matcher
+    char pending[CSRFP_MARKER_MAXLENGTH];// Start of a marker cut by the end of...
+                                        // ... the previous bucket
+    apr_size_t partial;                 // Bytes in pending
+    char tag[CSRFP_TAG_MAXLENGTH];      // <form>/<a> tag after its name, up to '>'
+    apr_size_t tagLen;                  // Bytes in tag, CSRFP_TAG_MAXLENGTH + 1 if...
+                                        // ... the tag was too long
+    apr_off_t scanned;                  // Bytes of the response scanned so far
+    char *scratch;                      // CSRFP_SCAN_CHUNK_SIZE buffer file buckets...
+                                        // ... are read through, allocated on first use
+    apr_bucket_brigade *tmpbb;          // Holds the unscanned rest of a brigade while...
+                                        // ... the scanned part is passed on
     Filter_State state;                 // Stores the current state of filter
-    char *script;                       // Will store the js code to be inserted
-    char *noscript;                     // Will store the <noscript>..</noscript>...
-                                        // ...Info to be inserted
+    const char *script;                 // js code to be inserted, from csrfp_config
+    apr_size_t scriptLen;               // Length of script
+    const char *noscript;               // <noscript>..</noscript> Info to be...
+                                        // ... inserted, from csrfp_config
+    apr_size_t noscriptLen;             // Length of noscript
     Filter_Cookie_Length_State clstate; // State of Content-Length header false - for not ...
                                         // ...modified, true for modified or need not modify
-    char *overlap_buf;                  // Buffer to store content of current bb->b buffer ...
-                                        // ... for next iteration in op filter [el]
+    apr_off_t origLength;               // Content-Length before injection
+    apr_size_t injected;                // Bytes injected so far
+    apr_bucket_brigade *holdbb;         // Response held back while its final length...
+                                        // ... is not known yet
+    const char *tokenQuery;             // ?<token name>=<token>, added to urls
+    const char *tokenArg;               // &<token name>=<token>, added to urls with a query
+    const char *tokenInput;             // hidden <input> with the token for GET forms
+    int validation;                     // CSRFP_VALIDATION_*, needvalidation() result
+    z_stream *zin;                      // Inflates gzip responses, NULL if not encoded
+    Bytef *zbuf;                        // CSRFP_GZIP_CHUNK_SIZE buffer zin inflates into
 } csrfp_opf_ctx;                        // CSRFP output filter context
 
-static csrfp_config *config;
+/*
+ * Variable: csrfp_gzip_ctx
+ * structure - state of csrfp_gzip_filter, compressing a response again
+ */
+typedef struct
+{
+    z_stream zs;                        // Deflate stream, gzip format
+    Bytef buf[CSRFP_GZIP_CHUNK_SIZE];   // Output of zs
+    apr_bucket_brigade *out;            // Compressed data passed on, kept across calls
+} csrfp_gzip_ctx;
 
 /*
  * Variable: getRuleNode
- * structure - linked list node for storing the GET rules
+ * structure - node for storing the GET rules
  */
 typedef struct getRuleNode
 {
     ap_regex_t *pattern;
     const char *patternString;
-    struct getRuleNode *next;
 };
 
-struct getRuleNode *getTop = NULL, *getPointer = NULL;
+/*
+ * Variable: csrfp_prefix_node
+ * structure - node of the trie of literal host and path prefixes of
+ * the verifyGetFor rules
+ */
+typedef struct csrfp_prefix_node
+{
+    char c;                             // Character of the edge to this node...
+                                        // ... '\0' for '.', any character
+    struct csrfp_prefix_node *child;    // First child
+    struct csrfp_prefix_node *next;     // Next sibling
+    apr_array_header_t *rules;          // Rules whose prefix ends here, NULL if none
+} csrfp_prefix_node;
+
+/*
+ * Variable: csrfp_rule_set
+ * structure - verifyGetFor rules compiled for matching, built at post config
+ */
+typedef struct csrfp_rule_set
+{
+    apr_array_header_t *all;            // Every rule of the set (struct getRuleNode *)
+    csrfp_prefix_node *index;           // Trie of the prefixes of the indexed rules...
+                                        // ... NULL if no rule could be indexed
+    apr_array_header_t *indexed;        // Rules in index (struct getRuleNode *)
+    ap_regex_t *combined;               // Rules as one alternation over both schemes...
+                                        // ... NULL if no rule could be combined
+    struct getRuleNode **groups;        // Rule of each capture group of combined...
+                                        // ... NULL for groups inside a rule
+    apr_size_t ngroups;                 // Capture groups of combined, plus the match
+    apr_array_header_t *single;         // Rules matched one by one (struct getRuleNode *)
+} csrfp_rule_set;
+
+/*
+ * Variable: csrfp_dir_config
+ * structure - per directory configuration, settings which can be scoped
+ * to <Directory> and <Location>
+ */
+typedef struct
+{
+    Flag flag;                          // Flag to check if CSRFP is disabled...
+                                        // ... CSRFP_FLAG_UNSET (enabled) if not set
+    apr_hash_t *ignoreExt;              // Lower case file extensions for which...
+                                        // ... validation is not needed, NULL for defaults
+    apr_hash_t *ignoreAdd;              // Extensions given in this scope, NULL if none
+    int ignoreNone;                     // 1 if 'none' was given, outer extensions...
+                                        // ... and the defaults are dropped
+    apr_array_header_t *ignorePrefix;   // Path prefixes for which validation...
+                                        // ... is not needed, NULL if none
+    csrfp_rule_set *rules;              // verifyGetFor rules, compiled at post config...
+                                        // ... NULL if not set in this scope
+} csrfp_dir_config;
+
+/*
+ * Variable: csrfp_rule_scope
+ * structure - configuration scope with verifyGetFor rules
+ */
+typedef struct
+{
+    server_rec *s;                      // Server the scope is configured in
+    csrfp_rule_set *rules;              // Rules of the scope
+} csrfp_rule_scope;
+
+// Scopes with verifyGetFor rules (csrfp_rule_scope), reset at pre config
+static apr_array_header_t *csrfp_rule_scopes = NULL;
+
+// Default csrfpIgnoreExtensions, built at pre config
+static apr_hash_t *csrfp_ignore_default = NULL;
+
+// Value of vhost settings left to csrfp_srv_config_merge
+static char csrfp_unset[] = "unset";
+
+/*
+ * Variable: csrfp_shm_header
+ * structure - header of the shared memory segment backing the
+ * token database, followed by the database pages and then by its
+ * rollback journal
+ */
+typedef struct
+{
+    apr_uint32_t magic;                 // CSRFP_SHM_MAGIC once initialised
+    volatile apr_uint32_t size;         // Current size of the database, bytes
+    apr_uint32_t capacity;              // Bytes available for the database
+    volatile apr_uint32_t journalSize;  // Current size of the journal, 0 if none
+    apr_uint32_t journalCapacity;       // Bytes available for the journal
+} csrfp_shm_header;
+
+/*
+ * Variable: csrfp_shm_file
+ * structure - sqlite3_file opened on the shared memory database or
+ * on its journal
+ */
+typedef struct
+{
+    sqlite3_file base;                  // Base class, must be first
+    csrfp_shm_header *hdr;              // Header of the segment
+    char *data;                         // First byte of the file
+    volatile apr_uint32_t *size;        // Current size of the file, in hdr
+    apr_uint32_t capacity;              // Bytes available for the file
+    int lock;                           // SQLITE_LOCK_* held by this handle
+} csrfp_shm_file;
+
+/*
+ * Variable: csrfp_snapshot_header
+ * structure - header of the token snapshot file, followed by count
+ * records
+ */
+typedef struct
+{
+    char magic[8];                      // CSRFP_SNAPSHOT_MAGIC
+    apr_uint32_t count;                 // Number of records
+    apr_uint32_t reserved;
+    apr_int64_t written;                // Unix time the snapshot was taken
+} csrfp_snapshot_header;
+
+/*
+ * Variable: csrfp_snapshot_record
+ * structure - one session of the token snapshot, followed by
+ * sessidLength bytes of sessid and tokenLength bytes of token
+ */
+typedef struct
+{
+    apr_int64_t timestamp;              // Time the token was issued
+    apr_uint16_t sessidLength;
+    apr_uint16_t tokenLength;
+    apr_uint32_t reserved;
+} csrfp_snapshot_record;
+
+/*
+ * Variable: csrfp_shm
+ * shared memory segment of the token store, created by the parent in
+ * post config and inherited by the children
+ */
+static apr_shm_t *csrfp_shm = NULL;
+
+/*
+ * Variable: csrfp_shm_mutex
+ * lock of the shm token database, created with the segment. SQLite's
+ * lock levels all map to it, and a dead holder releases it
+ */
+static apr_global_mutex_t *csrfp_shm_mutex = NULL;
+
+/*
+ * Variable: csrfp_snapshot_pid
+ * process which registered the snapshot, children inherit the
+ * cleanup and must not run it
+ */
+static pid_t csrfp_snapshot_pid = 0;
+
+/*
+ * Variable: csrfp_store_failures, csrfp_store_open_until
+ * circuit breaker state of the token store, per child process
+ */
+static volatile apr_uint32_t csrfp_store_failures = 0;
+static volatile apr_uint32_t csrfp_store_open_until = 0;
 //=============================================================
 // Globals
 //=============================================================
@@ -193,73 +559,131 @@ module AP_MODULE_DECLARE_DATA csrf_protector_module;
 
 // Declarations for functions
 static char *generateToken(request_rec *r, int length);
-static const char *csrfp_strncasestr(const char *s1, const char *s2, int len);
 static apr_table_t *csrfp_get_query(request_rec *r);
 static char* getCookieToken(request_rec *r, char *key);
+static void setTokenCookie(request_rec *r, sqlite3 *db);
 static csrfp_opf_ctx *csrfp_get_rctx(request_rec *r);
+static void csrfp_set_search(csrfp_opf_ctx *rctx);
 
 //Declarations for SQLite based functions
 static void csrfp_sql_table_clean(request_rec *r, sqlite3 *db);
 static sqlite3 *csrfp_sql_init(request_rec *r);
-static int csrfp_sql_match(request_rec *r, sqlite3 *db, const char *sessid, const char *value);
+static void csrfp_sql_close(request_rec *r, sqlite3 *db);
+static int csrfp_sql_error(request_rec *r, int rc);
+static int csrfp_sql_match(request_rec *r, sqlite3 *db, const char *sessid, const char *value,
+                            int *rc);
 static int csrfp_sql_addn(request_rec *r, sqlite3 *db, const char *sessid, const char *value);
 static char* csrfp_sql_get_token(request_rec *r, sqlite3 *db, const char *sessid);
 static int csrfp_sql_update_counter(request_rec *r, sqlite3 *db);
+static struct getRuleNode *csrfp_url_rule_match(request_rec *r, csrfp_rule_set *rules,
+                                                const char *url);
 
 //=============================================================
 // Functions
 //=============================================================
 
 /*
- * Function: csrfp_strncasestr
- * Similar to standard strstr() but case insensitive and lenght limitation
- * (char which is not 0 terminated).
+ * Variable: csrfp_find_fn
+ * signature of the byte scanners used by the marker matcher, returns the
+ * first byte in [s, e) equal to lo or up, NULL if none
+ */
+typedef const char *(*csrfp_find_fn)(const char *s, const char *e, char lo, char up);
+
+/*
+ * Function: csrfp_find_c
+ * Portable byte scanner, memchr() when both cases are the same byte
+ */
+static const char *csrfp_find_c(const char *s, const char *e, char lo, char up)
+{
+    if (lo == up) {
+        return (const char *)memchr(s, lo, e - s);
+    }
+    for ( ; s < e; s++) {
+        if (*s == lo || *s == up) return s;
+    }
+    return NULL;
+}
+
+#ifdef CSRFP_X86_SIMD
+/*
+ * Function: csrfp_find_sse2
+ * Byte scanner comparing 16 bytes at a time
+ */
+__attribute__((target("sse2")))
+static const char *csrfp_find_sse2(const char *s, const char *e, char lo, char up)
+{
+    const __m128i vlo = _mm_set1_epi8(lo);
+    const __m128i vup = _mm_set1_epi8(up);
+    for ( ; e - s >= 16; s += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vlo),
+                                                  _mm_cmpeq_epi8(v, vup)));
+        if (mask) return s + __builtin_ctz(mask);
+    }
+    return csrfp_find_c(s, e, lo, up);
+}
+
+/*
+ * Function: csrfp_find_avx2
+ * Byte scanner comparing 32 bytes at a time, tail handled by sse2
+ */
+__attribute__((target("avx2")))
+static const char *csrfp_find_avx2(const char *s, const char *e, char lo, char up)
+{
+    const __m256i vlo = _mm256_set1_epi8(lo);
+    const __m256i vup = _mm256_set1_epi8(up);
+    for ( ; e - s >= 32; s += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)s);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+                                _mm256_or_si256(_mm256_cmpeq_epi8(v, vlo),
+                                                _mm256_cmpeq_epi8(v, vup)));
+        if (mask) return s + __builtin_ctz(mask);
+    }
+    return csrfp_find_sse2(s, e, lo, up);
+}
+#endif
+
+/*
+ * Variable: csrfp_find
+ * byte scanner for this CPU, set once by csrfp_find_init()
+ */
+static csrfp_find_fn csrfp_find = csrfp_find_c;
+
+/*
+ * Function: csrfp_find_init
+ * Picks the widest byte scanner the CPU supports, called while
+ * registering hooks so children inherit the choice
  *
- * Parameters:
- * s1 - String to search in
- * s2 - Pattern to ind
- * len - Length of s1
- *
- * Rreturns:
- * char* - pointer to the beginning of the substring s2 within s1, or NULL
- *         if the substring is not found
- */
-static const char *csrfp_strncasestr(const char *s1, const char *s2, int len) {
-  const char *e1 = &s1[len-1];
-  char *p1, *p2;
-  if (*s2 == '\0') {
-    /* an empty s2 */
-    return((char *)s1);
-  }
-  while(1) {
-    for ( ; (*s1 != '\0') && (s1 <= e1) && (apr_tolower(*s1) != apr_tolower(*s2)); s1++);
-    if (*s1 == '\0' || s1 > e1) {
-      return(NULL);
-    }
-
-    /* found first character of s2, see if the rest matches */
-    p1 = (char *)s1;
-    p2 = (char *)s2;
-    for (++p1, ++p2; (apr_tolower(*p1) == apr_tolower(*p2)) && (p1 <= e1); ++p1, ++p2) {
-      if((p1 > e1) && (*p2 != '\0')) {
-        // reached the end without match
-        return NULL;
-      }
-      if (*p2 == '\0') {
-        /* both strings ended together */
-        return((char *)s1);
-      }
-    }
-    if (*p2 == '\0') {
-      /* second string ended, a match */
-      break;
-    }
-    /* didn't find a match here, try starting at next character in s1 */
-    s1++;
-  }
-  return((char *)s1);
+ * Returns:
+ * void
+ */
+static void csrfp_find_init(void)
+{
+#ifdef CSRFP_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        csrfp_find = csrfp_find_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        csrfp_find = csrfp_find_sse2;
+#endif
 }
 
+/*
+ * Variable: csrfp_markers
+ * text of each Marker, lower case; every marker holds '<' only as its
+ * first byte, the matcher relies on it
+ */
+static const struct {
+    const char *text;
+    apr_size_t len;
+} csrfp_markers[] = {
+    {"<head", sizeof("<head") - 1},
+    {"<body", sizeof("<body") - 1},
+    {"</body", sizeof("</body") - 1},
+    {"<form", sizeof("<form") - 1},
+    {"<a", sizeof("<a") - 1}
+};
+
 /*
  * Function: getCurrentUrl
  * Function to retrun current url
@@ -305,6 +729,39 @@ static char* generateToken(request_rec *r, int length)
     return token;
 }
 
+/*
+ * Function: csrfp_issue_token
+ * Sets the token cookies once per request, see setTokenCookie
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:
+ * token set for the request, NULL if the token store failed
+ */
+static const char *csrfp_issue_token(request_rec *r)
+{
+    const char *token = apr_table_get(r->notes, CSRFP_TOKEN_NOTE);
+    if (token != NULL)
+        return token;
+
+    // Start the sql connection
+    sqlite3 *db = csrfp_sql_init(r);
+    if (db == NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+                  "CSRFP UNABLE TO ACCESS DB OBJECT TO ISSUE TOKEN");
+        return NULL;
+    }
+    setTokenCookie(r, db);
+
+    // Clean old expired values
+    csrfp_sql_table_clean(r, db);
+
+    // Close the sql connection
+    csrfp_sql_close(r, db);
+    return apr_table_get(r->notes, CSRFP_TOKEN_NOTE);
+}
+
 /*
  * Funciton: csrfp_get_query
  * Returns a table containing the query name/value pairs.
@@ -370,9 +827,10 @@ static void setTokenCookie(request_rec *r, sqlite3 *db)
 
     cookie = apr_psprintf(r->pool, "%s=%s; Version=1; Path=/; HttpOnly;", CSRFP_SESS_TOKEN, sessid);
     apr_table_addn(r->headers_out, "Set-Cookie", cookie);
+    apr_table_setn(r->notes, CSRFP_TOKEN_NOTE, token);
 
     // Add / Update it to database
-    csrfp_sql_addn(r, db, sessid, token);
+    csrfp_sql_error(r, csrfp_sql_addn(r, db, sessid, token));
                   
     // Update counter & reseed if needed
     int counter = csrfp_sql_update_counter(r, db);
@@ -434,16 +892,17 @@ static char* getCookieToken(request_rec *r, char *key)
 
 
 /*
- * Function: validateToken
- * Function to validate GET token, csrfp_token in GET query parameter
+ * Function: getRequestToken
+ * Function to return the token sent with the request, either as
+ * GET query parameter or as request header
  *
  * Parameters: 
  * r - request_rec pointer
  *
  * Return: 
- * int, 0 - for failed validation, 1 - for passed
+ * token value - if sent with the request, else NULL
  */
-static int validateToken(request_rec *r, sqlite3 *db)
+static const char *getRequestToken(request_rec *r)
 {
     csrfp_config *conf = ap_get_module_config(r->server->module_config,
                                                 &csrf_protector_module);
@@ -452,15 +911,31 @@ static int validateToken(request_rec *r, sqlite3 *db)
     apr_table_t *GET = NULL;
     GET = csrfp_get_query(r);
 
-    const char *tokenValue = NULL;
     // Extracting token
     if (GET) {
-        tokenValue = apr_table_get(GET, conf->tokenName);
-    }
-    else {
-        tokenValue = apr_table_get(r->headers_in, conf->tokenName);
+        return apr_table_get(GET, conf->tokenName);
     }
+    return apr_table_get(r->headers_in, conf->tokenName);
+}
+
+/*
+ * Function: validateToken
+ * Function to validate GET token, csrfp_token in GET query parameter
+ *
+ * Parameters: 
+ * r - request_rec pointer
+ * db - sqlite database object
+ * rc - set to the SQLite result code of the lookup, SQLITE_OK if none
+ *
+ * Return: 
+ * int, 0 - for failed validation, 1 - for passed
+ */
+static int validateToken(request_rec *r, sqlite3 *db, int *rc)
+{
+    const char *tokenValue = getRequestToken(r);
     
+    *rc = SQLITE_OK;
+
     // Verifying token
     if (!tokenValue) return 0;
     else {
@@ -469,12 +944,36 @@ static int validateToken(request_rec *r, sqlite3 *db)
         if (sessid == NULL) {
             return 0;
         }
-        if ( !csrfp_sql_match(r, db, sessid, tokenValue)) return 1;
+        if ( !csrfp_sql_match(r, db, sessid, tokenValue, rc)) return 1;
         //token doesn't match
         return 0;
     }
 }
 
+/*
+ * Function: validateTokenStateless
+ * Function to validate the request token without the token store,
+ * by comparing it against the token cookie sent by the client
+ *
+ * Parameters: 
+ * r - request_rec pointer
+ *
+ * Return: 
+ * int, 0 - for failed validation, 1 - for passed
+ */
+static int validateTokenStateless(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    const char *tokenValue = getRequestToken(r);
+    char *cookieValue = getCookieToken(r, conf->tokenName);
+
+    if (!tokenValue || !cookieValue) return 0;
+    if (strlen(cookieValue) < DEFAULT_TOKEN_MINIMUM_LENGTH) return 0;
+    return !strcmp(tokenValue, cookieValue);
+}
+
 /*
  * Function: getOutputContentType
  * Returns content type of output generated by content generator
@@ -517,42 +1016,20 @@ static csrfp_opf_ctx *csrfp_get_rctx(request_rec *r) {
 
     rctx = apr_pcalloc(r->pool, sizeof(csrfp_opf_ctx));
     rctx->state = op_init;
-    rctx->search = apr_psprintf(r->pool, "<body");
-
-    // Allocate memory and init <noscript> content to be injected
-    rctx->noscript = apr_psprintf(r->pool, "\n<noscript>\n%s\n</noscript>",
-                                conf->disablesJsMessage);
-
-    // Parse the getRule linked list and generate the rule string to be appended to js
-    struct getRuleNode *p = getTop;
-    char *getRuleString = NULL;
-    while (p != NULL) {
-        if (getRuleString)
-            getRuleString = apr_pstrcat(r->pool, getRuleString, ",'" , p->patternString , "'", NULL);
-        else
-            getRuleString = apr_pstrcat(r->pool, "'" , p->patternString , "'", NULL);
-
-        p = p->next;
-    }
-
-    // Allocate memory and init <script> content to be injected
-    rctx->script = apr_psprintf(r->pool, "\n<script type=\"text/javascript\""
-                               " src=\"%s\"></script>\n"
-                               "<script type=\"text/JavaScript\">\n"
-                               "window.onload = function() {\n"
-                               "\t  CSRFP.checkForUrls = [%s];\n"
-                               "\t  CSRFP.CSRFP_TOKEN = '%s';\n"
-                               "\t  csrfprotector_init();\n"
-                               "}\n</script>\n",
-                                conf->jsFilePath,
-                                (getRuleString == NULL)?"": getRuleString,
-                                conf->tokenName);
+    rctx->search[0] = (conf->injectMode == inject_head) ? marker_head : marker_body;
+    rctx->search[1] = marker_body;
+    rctx->ninject = (conf->injectMode == inject_head) ? 2 : 1;
+    rctx->nsearch = rctx->ninject;
+    rctx->scan = scan_marker;
+    rctx->partial = 0;
+
+    // Fragments are the same for every request, built by csrfp_build_fragments
+    rctx->noscript = conf->noscript;
+    rctx->noscriptLen = conf->noscriptLen;
+    rctx->script = conf->script;
+    rctx->scriptLen = conf->scriptLen;
 
     rctx->clstate = nmodified;
-    rctx->overlap_buf = apr_pcalloc(r->pool, CSRFP_OVERLAP_BUCKET_SIZE);
-    apr_cpystrn(rctx->overlap_buf,
-        CSRFP_OVERLAP_BUCKET_DEFAULT, CSRFP_OVERLAP_BUCKET_SIZE);
-
 
     // globalise this configuration
     ap_set_module_config(r->request_config, &csrf_protector_module, rctx);
@@ -562,785 +1039,3952 @@ static csrfp_opf_ctx *csrfp_get_rctx(request_rec *r) {
 
 
 /*
- * Function: csrfp_inject
- * Injects a new bucket containing a reference to the javascript.
+ * Function: csrfp_marker_match
+ * Compares the start of a tag with the markers being searched
  *
  * Parametes:
- * r - request_rec object
- * bb - bucket_brigade object
- * b Bucket to split and insert date new bucket at the postion of the marker
- * rctx - Request context containing the state of the parser
- * buf - String representation of the bucket
- * sz  - Position to split the bucket and insert the new content
- * flag - 0 - for <noscript> insertion, 1 for <script> insertion
+ * rctx - Request context, holds the markers being searched
+ * c - data starting with '<'
+ * n - bytes available at c
  *
- * Returns: 
- * Bucket to continue searching (at the marker)
+ * Returns:
+ * int, index into rctx->search of the marker found, CSRFP_MARKER_PREFIX
+ * if c is too short to tell, CSRFP_MARKER_NONE if no marker matches
  */
-static apr_bucket *csrfp_inject(request_rec *r, apr_bucket_brigade *bb, apr_bucket *b,
-                                    csrfp_opf_ctx *rctx, const char *buf,
-                                    apr_size_t sz, int flag) {
-    apr_bucket *e;
-    apr_bucket_split(b, sz);
-    b = APR_BUCKET_NEXT(b);
+static int csrfp_marker_match(csrfp_opf_ctx *rctx, const char *c, apr_size_t n)
+{
+    int i, prefix = 0;
+    for (i = 0; i < rctx->nsearch; i++) {
+        apr_size_t len = csrfp_markers[rctx->search[i]].len;
+        apr_size_t cmp = (n < len) ? n : len;
+        if (!strncasecmp(c, csrfp_markers[rctx->search[i]].text, cmp)) {
+            if (cmp == len) return i;
+            prefix = 1;
+        }
+    }
+    return prefix ? CSRFP_MARKER_PREFIX : CSRFP_MARKER_NONE;
+}
 
-    const char* insert = (flag == 1)? rctx->script : rctx->noscript;
+/*
+ * Function: csrfp_scan
+ * Streaming marker matcher, scans one bucket's data in place for any of
+ * rctx->search followed by the end of the tag name and the closing
+ * '>' of that tag. Candidate '<' are located with csrfp_find. A marker
+ * cut by the end of the bucket is kept in rctx->pending, so nothing
+ * else is copied or allocated
+ *
+ * Parametes:
+ * rctx - Request context containing the state of the matcher
+ * buf - data of the bucket
+ * len - length of buf
+ * offset - set to the position just after the tag's '>' when found,
+ *          rctx->matched tells which marker it was
+ *
+ * Returns:
+ * int, 1 if the tag ended within buf, 0 if more data is needed
+ */
+static int csrfp_scan(csrfp_opf_ctx *rctx, const char *buf, apr_size_t len,
+                        apr_size_t *offset)
+{
+    apr_size_t i = 0;
+    const char *c;
+    int m;
+
+    while (i < len) {
+        switch (rctx->scan) {
+        case scan_marker:
+            if (rctx->partial > 0) {
+                // Continue the marker started at the end of the previous bucket
+                while (i < len) {
+                    rctx->pending[rctx->partial] = buf[i];
+                    m = csrfp_marker_match(rctx, rctx->pending, rctx->partial + 1);
+                    if (m == CSRFP_MARKER_NONE) {
+                        // buf[i] may start a marker itself
+                        rctx->partial = 0;
+                        break;
+                    }
+                    i++;
+                    rctx->partial++;
+                    if (m != CSRFP_MARKER_PREFIX) {
+                        rctx->matched = rctx->search[m];
+                        rctx->partial = 0;
+                        rctx->tagLen = 0;
+                        rctx->scan = scan_boundary;
+                        break;
+                    }
+                }
+                break;
+            }
 
-    e = apr_bucket_pool_create(insert, strlen(insert), r->pool, bb->bucket_alloc);
+            c = csrfp_find(buf + i, buf + len, '<', '<');
+            if (c == NULL) {
+                return 0;
+            }
+            i = c - buf;
+            m = csrfp_marker_match(rctx, c, len - i);
+            if (m == CSRFP_MARKER_NONE) {
+                i++;
+            } else if (m == CSRFP_MARKER_PREFIX) {
+                // Marker cut by the end of the bucket
+                rctx->partial = len - i;
+                memcpy(rctx->pending, c, rctx->partial);
+                return 0;
+            } else {
+                rctx->matched = rctx->search[m];
+                i += csrfp_markers[rctx->matched].len;
+                rctx->tagLen = 0;
+                rctx->scan = scan_boundary;
+            }
+            break;
 
-    APR_BUCKET_INSERT_BEFORE(b, e);
+        case scan_boundary:
+            // <body> <body ...> <body/>, but not <bodyx
+            if (buf[i] == '>') {
+                rctx->scan = scan_marker;
+                *offset = i + 1;
+                return 1;
+            }
+            rctx->scan = (apr_isspace(buf[i]) || buf[i] == '/')
+                            ? scan_tag_end : scan_marker;
+            break;
 
-    if (flag) {
-        // script has been injected
-        rctx->state = op_body_end;
-        rctx->search = NULL;
-    } else {
-        // <noscript> has been injected
-        rctx->state = op_body_init;
-        apr_cpystrn(rctx->search, "</body>", strlen("</body>"));
+        case scan_tag_end:
+            c = memchr(buf + i, '>', len - i);
+            if (rctx->matched >= marker_form) {
+                // csrfp_rewrite needs the attributes
+                apr_size_t n = ((c == NULL) ? len : (apr_size_t)(c - buf)) - i;
+                if (rctx->tagLen + n > CSRFP_TAG_MAXLENGTH) {
+                    rctx->tagLen = CSRFP_TAG_MAXLENGTH + 1;
+                } else {
+                    memcpy(rctx->tag + rctx->tagLen, buf + i, n);
+                    rctx->tagLen += n;
+                }
+            }
+            if (c == NULL) {
+                return 0;
+            }
+            rctx->scan = scan_marker;
+            *offset = c - buf + 1;
+            return 1;
+        }
     }
-
-    return b;
+    return 0;
 }
 
 /*
- * Function: logCSRFAttack
- * Function to log an attack
+ * Function: csrfp_scan_file
+ * Runs csrfp_scan over a file bucket in CSRFP_SCAN_CHUNK_SIZE steps
+ * through the request's scratch buffer. Unlike apr_bucket_read() the
+ * bucket is not morphed into heap or mmap buckets, so what is left of
+ * it can still be sent with sendfile
  *
- * Parameters:
- * r -  request_rec object
+ * Parametes:
+ * r - request_rec object
+ * rctx - Request context containing the state of the matcher
+ * b - file bucket
+ * len - bytes of the bucket to scan
+ * offset - set to the position just after the tag's '>' when found
+ * found - set to 1 if the tag ended within len bytes
  *
  * Returns:
- * void
+ * apr_status_t, of reading the file
  */
-static void logCSRFAttack(request_rec *r)
+static apr_status_t csrfp_scan_file(request_rec *r, csrfp_opf_ctx *rctx, apr_bucket *b,
+                                    apr_size_t len, apr_size_t *offset, int *found)
 {
-    csrfp_config *conf = ap_get_module_config(r->server->module_config,
-                                                &csrf_protector_module);
+    apr_bucket_file *a = (apr_bucket_file *)b->data;
+    apr_size_t pos = 0, n;
+    apr_status_t rv;
 
-    int isGet = (!strcmp(r->method, "GET"));
-    const char *POSTArgs;   //#todo a way to log POST arguments
-    // Log the failure
-    ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-                      "CSRF ATTACK, %s, action=%d, method=%s, arguments=%s, url=%s%s", 
-                      conf->action == strip ? "strip & served" : "denied",
-                      conf->action,
-                      (isGet)? "GET" : "POST",
-                      (isGet)? r->args: "POSTArgs", //remove ""
-                      "https(s)://",
-                      getCurrentUrl(r));
+    if (rctx->scratch == NULL) {
+        rctx->scratch = apr_palloc(r->pool, CSRFP_SCAN_CHUNK_SIZE);
+    }
+
+    *found = 0;
+    while (pos < len) {
+        // file_bucket_read() seeks before each read too, sharing fd is fine
+        apr_off_t at = b->start + pos;
+        rv = apr_file_seek(a->fd, APR_SET, &at);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        n = (len - pos < CSRFP_SCAN_CHUNK_SIZE) ? len - pos : CSRFP_SCAN_CHUNK_SIZE;
+        rv = apr_file_read_full(a->fd, rctx->scratch, n, &n);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        if (csrfp_scan(rctx, rctx->scratch, n, offset)) {
+            *offset += pos;
+            *found = 1;
+            return APR_SUCCESS;
+        }
+        pos += n;
+    }
+    return APR_SUCCESS;
 }
 
 /*
- * Function: failedValidationAction
- * Returns appropriate status code, as per configuration
- * For failed validation action
+ * Function: csrfp_inject
+ * Injects new buckets containing the <noscript> info or the reference
+ * to the javascript after the tag rctx->matched, and moves on to the
+ * next markers
  *
- * Parameters:
+ * Parametes:
  * r - request_rec object
+ * bb - bucket_brigade object
+ * b Bucket to split and insert date new bucket at the postion of the marker
+ * rctx - Request context containing the state of the parser
+ * sz  - Position to split the bucket and insert the new content
  *
- * Returns:  
- * int - status code for action
+ * Returns:
+ * Bucket to continue searching (after the inserted content)
  */
-static int failedValidationAction(request_rec *r)
+static apr_bucket *csrfp_inject(request_rec *r, apr_bucket_brigade *bb, apr_bucket *b,
+                                    csrfp_opf_ctx *rctx, apr_size_t sz) {
+    apr_bucket *e = b;
+    int script = 0, noscript = 0;
+
+    if (sz < b->length) {
+        apr_bucket_split(b, sz);
+    }
+
+    switch (rctx->matched) {
+    case marker_head:
+        // head mode, deferred script goes in <head>
+        script = 1;
+        rctx->state = op_head_init;
+        rctx->search[0] = marker_body;
+        rctx->ninject = 1;
+        break;
+    case marker_body:
+        noscript = 1;
+        if (rctx->ninject == 2) {
+            // head mode, but no <head> before <body>, script goes here
+            script = 1;
+            rctx->ninject = 0;
+            rctx->state = op_body_end;
+        } else if (rctx->state == op_head_init) {
+            rctx->ninject = 0;
+            rctx->state = op_body_end;
+        } else {
+            rctx->state = op_body_init;
+            rctx->search[0] = marker_body_end;
+        }
+        break;
+    case marker_body_end:
+        script = 1;
+        rctx->ninject = 0;
+        rctx->state = op_body_end;
+        break;
+    default:
+        break;
+    }
+    csrfp_set_search(rctx);
+
+    // Fragments live in the configuration pool, which outlives the request
+    if (noscript) {
+        APR_BUCKET_INSERT_AFTER(e, apr_bucket_immortal_create(rctx->noscript,
+                                    rctx->noscriptLen, bb->bucket_alloc));
+        e = APR_BUCKET_NEXT(e);
+        rctx->injected += rctx->noscriptLen;
+    }
+    if (script) {
+        APR_BUCKET_INSERT_AFTER(e, apr_bucket_immortal_create(rctx->script,
+                                    rctx->scriptLen, bb->bucket_alloc));
+        e = APR_BUCKET_NEXT(e);
+        rctx->injected += rctx->scriptLen;
+    }
+
+    return APR_BUCKET_NEXT(e);
+}
+
+/*
+ * Function: csrfp_set_search
+ * Puts the markers of csrfpRewriteForms after the injection markers
+ * left in rctx->search
+ *
+ * Parameters:
+ * rctx - Request context
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_set_search(csrfp_opf_ctx *rctx)
 {
-    csrfp_config *conf = ap_get_module_config(r->server->module_config,
-                                                &csrf_protector_module);
-    
-    logCSRFAttack(r);   // Log this attack
+    int n = rctx->ninject;
 
-    switch (conf->action)
-    {
-        case forbidden:
-            return HTTP_FORBIDDEN;
-            break;
-        case strip:
-            // Strip POST values - and forward the request
-            if (!strcmp(r->method, "GET")
-                && r->args) {
-                apr_cpystrn(r->args, "\0", 1);
-            } else if (!strcmp(r->method, "POST")) {
-                ap_discard_request_body(r);
-                apr_table_addn(r->headers_out, "POST_DATA_CLEARING", "reached");
-            }
-            return OK;
-            break;
-        case redirect:
-            // Redirect to custom uri
-            if (strlen(conf->errorRedirectionUri) > 0) {
-                apr_table_add(r->headers_out, "Location", conf->errorRedirectionUri);
-                return HTTP_MOVED_PERMANENTLY;
-            } else {
-                return HTTP_FORBIDDEN;
+    if (rctx->rewrite & CSRFP_REWRITE_FORMS)
+        rctx->search[n++] = marker_form;
+    if (rctx->rewrite & CSRFP_REWRITE_LINKS)
+        rctx->search[n++] = marker_a;
+    rctx->nsearch = n;
+}
+
+/*
+ * Function: csrfp_tag_attr
+ * Finds an attribute in the tag saved by csrfp_scan
+ *
+ * Parameters:
+ * tag - attributes of the tag, without its name and '>'
+ * len - length of tag
+ * name - attribute name, lower case
+ * value - set to the value, inside the quotes if any, NULL if the
+ *         attribute has no value
+ * vlen - set to the length of value
+ *
+ * Returns:
+ * int, 1 if the attribute was found
+ */
+static int csrfp_tag_attr(const char *tag, apr_size_t len, const char *name,
+                            const char **value, apr_size_t *vlen)
+{
+    apr_size_t i = 0, s, nlen = strlen(name);
+    int match;
+
+    while (i < len) {
+        while (i < len && (apr_isspace(tag[i]) || tag[i] == '/'))
+            i++;
+        s = i;
+        while (i < len && !apr_isspace(tag[i]) && tag[i] != '=' && tag[i] != '/')
+            i++;
+        match = (i - s == nlen && !strncasecmp(tag + s, name, nlen));
+
+        while (i < len && apr_isspace(tag[i]))
+            i++;
+        if (i >= len || tag[i] != '=') {
+            if (match) {
+                *value = NULL;
+                *vlen = 0;
+                return 1;
             }
-            break;
-        case message:
-            // Show custom Error Message
-            ap_rprintf(r, "<h2>%s</h2>", conf->errorCustomMessage);
-            return DONE;
-            break;
-        case internal_server_error:
-            // Show internel Server error
-            return HTTP_INTERNAL_SERVER_ERROR;
-            break;
-        default:
-            // Default action is FORBIDDEN
-            return HTTP_FORBIDDEN;
-            break;
+            continue;
+        }
+
+        i++;
+        while (i < len && apr_isspace(tag[i]))
+            i++;
+        if (i < len && (tag[i] == '"' || tag[i] == '\'')) {
+            char q = tag[i++];
+            s = i;
+            while (i < len && tag[i] != q)
+                i++;
+            if (i >= len)
+                return 0;
+        } else {
+            s = i;
+            while (i < len && !apr_isspace(tag[i]))
+                i++;
+        }
+        if (match) {
+            *value = tag + s;
+            *vlen = i - s;
+            return 1;
+        }
+        i++;
     }
+    return 0;
 }
 
 /*
- * Function: needvalidation
- * Function to decide weather to validate current request
- * Depending upon requested file, matched against ignore pattern
+ * Function: csrfp_link_url
+ * Resolves a url of the page against the request, like the js does
+ * for links it rewrites
  *
- * Parameters: 
+ * Parameters:
  * r - request_rec object
+ * v - url as written in the page
+ * vlen - length of v
  *
- * Returns: 
- * int, - 1 if validation needed, 0 otherwise
+ * Returns:
+ * host and path of the url, NULL if it is not on this host
  */
-static int needvalidation(request_rec *r)
+static char *csrfp_link_url(request_rec *r, const char *v, apr_size_t vlen)
 {
-    if (apr_table_get(r->subprocess_env, CSRFP_IGNORE_TEXT))
-        return 0;
+    apr_size_t n = 0, h;
+    char *path;
+
+    // path only, query and fragment do not take part in the rules
+    while (n < vlen && v[n] != '?' && v[n] != '#')
+        n++;
+
+    if (n >= 2 && v[0] == '/' && v[1] == '/') {
+        v += 2;
+        n -= 2;
+    } else if (n >= 7 && !strncasecmp(v, "http://", 7)) {
+        v += 7;
+        n -= 7;
+    } else if (n >= 8 && !strncasecmp(v, "https://", 8)) {
+        v += 8;
+        n -= 8;
+    } else {
+        for (h = 0; h < n && v[h] != '/'; h++) {
+            if (v[h] == ':') {
+                // mailto:, javascript: ...
+                return NULL;
+            }
+        }
 
-    csrfp_config *conf = ap_get_module_config(r->server->module_config,
-                                                &csrf_protector_module);
-    if(r->parsed_uri.path) {
-        const char *path = strrchr(r->parsed_uri.path, '/');
-        // faster than match against a long string
-        if(path == NULL) {
-            path = r->parsed_uri.path;
-        }
-        if(ap_regexec(conf->ignore_pattern, path, 0, NULL, 0) == 0) {
-            apr_table_addn(r->subprocess_env, CSRFP_IGNORE_TEXT, "m");
-            return 0;
+        if (n > 0 && v[0] == '/') {
+            path = apr_pstrmemdup(r->pool, v, n);
+        } else {
+            const char *dir = strrchr(r->uri, '/');
+            path = apr_pstrcat(r->pool,
+                        apr_pstrmemdup(r->pool, r->uri, dir ? dir - r->uri + 1 : 0),
+                        apr_pstrmemdup(r->pool, v, n), NULL);
         }
+        ap_getparents(path);
+        return apr_pstrcat(r->pool, r->hostname, path, NULL);
     }
-    return 1;
+
+    // absolute, same host (any port) only
+    for (h = 0; h < n && v[h] != '/' && v[h] != ':'; h++)
+        ;
+    if (r->hostname == NULL || h != strlen(r->hostname)
+        || strncasecmp(v, r->hostname, h))
+        return NULL;
+    while (h < n && v[h] != '/')
+        h++;
+
+    return apr_pstrcat(r->pool, r->hostname,
+                (h < n) ? apr_pstrmemdup(r->pool, v + h, n - h) : "/", NULL);
 }
 
-//=============================================================
-// All SQLite related functions
-//=============================================================
+/*
+ * Function: csrfp_insert_at
+ * Inserts a string at a position of a bucket
+ *
+ * Parameters:
+ * r - request_rec object
+ * b - bucket
+ * at - position in b
+ * str - string to insert, lives in the request pool
+ * rctx - Request context, counts the bytes injected
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_insert_at(request_rec *r, apr_bucket *b, apr_size_t at,
+                            const char *str, csrfp_opf_ctx *rctx)
+{
+    apr_size_t len = strlen(str);
+
+    if (at < b->length) {
+        apr_bucket_split(b, at);
+    }
+    APR_BUCKET_INSERT_AFTER(b, apr_bucket_pool_create(str, len, r->pool,
+                                r->connection->bucket_alloc));
+    rctx->injected += len;
+}
 
 /*
- * Function: csrfp_sql_init
- * Function to initiate the sql process for code validation
+ * Function: csrfp_rewrite
+ * Puts the token in the <form> or <a> tag rctx->matched, which ended
+ * at sz in the bucket:
+ * - GET forms get a hidden input after the tag
+ * - other forms get it in their action url, like the js does on submit,
+ *   a missing or empty action becomes the url of the page
+ * - links matching a verifyGetFor rule get it in their href
+ * Only urls of this host are changed
  *
- * Parameters: 
+ * Parametes:
  * r - request_rec object
+ * b - bucket the tag ended in
+ * rctx - Request context, holds the tag and the token strings
+ * sz - position just after the tag's '>' in b
  *
- * Returns: 
- * db, SQLITE database object on success
+ * Returns:
+ * Bucket to continue searching (after the tag)
  */
-static sqlite3 *csrfp_sql_init(request_rec *r)
+static apr_bucket *csrfp_rewrite(request_rec *r, apr_bucket *b, csrfp_opf_ctx *rctx,
+                                    apr_size_t sz)
 {
     csrfp_config *conf = ap_get_module_config(r->server->module_config,
                                                 &csrf_protector_module);
+    apr_bucket *next;
+    const char *v, *m;
+    apr_size_t vlen, at, tagAt;
+    int has;
 
-    sqlite3 *db;
-    int rc = sqlite3_open_v2(DATABASE_DEFAULT_LOCATION, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
-    if (rc != SQLITE_OK) {
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-init-open-error", sqlite3_errmsg(db));
-        #endif
-        return NULL;
+    if (sz < b->length) {
+        apr_bucket_split(b, sz);
     }
+    next = APR_BUCKET_NEXT(b);
 
-    //#todo: make sessid, token length configurable. also timestamp length
-    // & compile this sql string based on those values here
-    const char* sql = apr_psprintf(r->pool, "CREATE TABLE IF NOT EXISTS CSRFP("  \
-         "sessid char(%d) PRIMARY KEY NOT NULL," \
-         "token char(%d) NOT NULL,"\
-         "timestamp int NOT NULL );", 20, conf->tokenLength);
-
-    // Error reporting 
-    char *zErrMsg = 0;
-
-    /* Execute SQL statement */
-    rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
-    if( rc != SQLITE_OK ){
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-init-exec-error", zErrMsg);
-        #endif
-        return NULL;
+    // too long to keep, or began in an earlier bucket: left to the js
+    if (rctx->tagLen > CSRFP_TAG_MAXLENGTH || sz - 1 < rctx->tagLen) {
+        return next;
     }
+    tagAt = sz - 1 - rctx->tagLen;
+
+    if (rctx->matched == marker_form) {
+        if (csrfp_tag_attr(rctx->tag, rctx->tagLen, "method", &v, &vlen) == 0
+            || v == NULL || (vlen == 3 && !strncasecmp(v, "get", 3))) {
+            // GET forms replace the query of action with their fields
+            has = csrfp_tag_attr(rctx->tag, rctx->tagLen, "action", &v, &vlen);
+            if (has && (v == NULL || (vlen > 0 && !csrfp_link_url(r, v, vlen)))) {
+                return next;
+            }
+            csrfp_insert_at(r, b, sz, rctx->tokenInput, rctx);
+            return next;
+        }
 
-    // Create a table for storing, the requests count
-    sql = apr_psprintf(r->pool, "CREATE TABLE IF NOT EXISTS CSRFP_COUNTER (" \
-            "counter int NOT NULL );");
+        has = csrfp_tag_attr(rctx->tag, rctx->tagLen, "action", &v, &vlen);
+        if (!has || (v != NULL && vlen == 0)) {
+            // no action posts to this page, its query included, as the
+            // browser shows it: the url before any internal redirect
+            const request_rec *self = r;
+            const char *action;
+
+            while (self->prev != NULL)
+                self = self->prev;
+            action = apr_pstrcat(r->pool, ap_escape_html(r->pool, self->unparsed_uri),
+                                 strchr(self->unparsed_uri, '?') ? rctx->tokenArg
+                                                                 : rctx->tokenQuery, NULL);
+            if (!has) {
+                csrfp_insert_at(r, b, sz - 1, apr_pstrcat(r->pool, " action=\"",
+                                    action, "\"", NULL), rctx);
+            } else {
+                csrfp_insert_at(r, b, tagAt + (v - rctx->tag), action, rctx);
+            }
+            return next;
+        }
+        if (v == NULL || (vlen > 0 && !csrfp_link_url(r, v, vlen))) {
+            return next;
+        }
+    } else {
+        if (!csrfp_tag_attr(rctx->tag, rctx->tagLen, "href", &v, &vlen) || v == NULL
+            || vlen == 0 || v[0] == '#') {
+            return next;
+        }
+        char *url = csrfp_link_url(r, v, vlen);
+        if (url == NULL || csrfp_url_rule_match(r, conf->allRules, url) == NULL) {
+            return next;
+        }
+    }
 
-    rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
-    if( rc != SQLITE_OK ){
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-init-counter-error", zErrMsg);
-        #endif
-        return NULL;
-    }    
+    // url already carrying a token is left as it is
+    m = memchr(v, '#', vlen);
+    at = m ? (apr_size_t)(m - v) : vlen;
+    for (m = v; m + strlen(conf->tokenName) < v + at; m++) {
+        if (!strncmp(m, conf->tokenName, strlen(conf->tokenName))
+            && m[strlen(conf->tokenName)] == '=') {
+            return next;
+        }
+    }
 
-    return db;
+    csrfp_insert_at(r, b, tagAt + (v - rctx->tag) + at,
+                    memchr(v, '?', at) ? rctx->tokenArg : rctx->tokenQuery, rctx);
+    return next;
 }
 
 /*
- * Function: csrfp_sql_update_counter
- * Function to add / Update counter value for reseeding
+ * Function: csrfp_rewrite_init
+ * Sets the token for csrfpRewriteForms and starts searching forms
+ * and links. The page then holds the user's token, it is kept out
+ * of shared caches
  *
- * Parameters: 
+ * Parameters:
  * r - request_rec object
- * db - sqlite database object
+ * rctx - Request context
  *
- * Returns: 
- * integer, current counter
+ * Returns:
+ * void
  */
-static int csrfp_sql_update_counter(request_rec *r, sqlite3 *db)
+static void csrfp_rewrite_init(request_rec *r, csrfp_opf_ctx *rctx)
 {
-    // Check if exist -- true > update, false > insert 1
-    int counter = 1;
-    int shouldUpdate = 0;
-    sqlite3_stmt *res;
-    const char *tail;
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    const char *token = csrfp_issue_token(r);
 
-    // #todo: you might want to create a seperate pool for this & destroy it later
-    const char *sql = apr_psprintf(r->pool, "SELECT counter FROM CSRFP_COUNTER");
-    int rc = sqlite3_prepare_v2(db, sql, 1000, &res, &tail);
-    if (rc != SQLITE_OK) {
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-update-counter-select-error", tail);
-        #endif
-        return rc;
-    } else {
-        while (sqlite3_step(res) == SQLITE_ROW) {
-            counter = atoi(sqlite3_column_text(res, 0));
-            ++shouldUpdate;
-            break;
-        }
+    if (token == NULL) {
+        // left to the js
+        return;
     }
-    sqlite3_reset(res);
 
-    char *zErrMsg = NULL;
-    if (shouldUpdate != 0) {
-        //means entry exist -- update
-        sql = apr_psprintf(r->pool, "UPDATE CSRFP_COUNTER SET counter = counter + 1");
-        rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
-        if (rc != SQLITE_OK) {
-            #ifdef DEBUG
-                apr_table_addn(r->headers_out, "sql-update-counter-update-error", zErrMsg);
-            #endif
-            return rc;
-        }
-        counter++;
-    } else {
-        // Insert
-        sql = apr_psprintf(r->pool, "INSERT INTO CSRFP_COUNTER (counter) VALUES (1)");
-        rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
-        if (rc != SQLITE_OK) {
-            #ifdef DEBUG
-                apr_table_addn(r->headers_out, "sql-update-counter-insert-error", zErrMsg);
-            #endif
-            return rc;
-        }
-    }
-    #ifdef DEBUG
-        apr_table_addn(r->headers_out, "sql-update-counter-value", apr_itoa(r->pool, counter));
-    #endif
-    return counter;
+    rctx->tokenQuery = apr_psprintf(r->pool, "?%s=%s", conf->tokenName, token);
+    rctx->tokenArg = apr_psprintf(r->pool, "&%s=%s", conf->tokenName, token);
+    rctx->tokenInput = apr_psprintf(r->pool,
+                            "<input type=\"hidden\" name=\"%s\" value=\"%s\">",
+                            conf->tokenName, token);
+
+    rctx->rewrite = CSRFP_REWRITE_FORMS | ((conf->allRules != NULL) ? CSRFP_REWRITE_LINKS : 0);
+    csrfp_set_search(rctx);
+
+    apr_table_unset(r->headers_out, "ETag");
+    apr_table_mergen(r->headers_out, "Cache-Control", "private");
 }
 
 /*
- * Function: csrfp_sql_get_token
- * Function to get token for session
+ * Function: csrfp_zin_cleanup
+ * Pool cleanup, frees the inflate state of a response
  *
- * Parameters: 
- * r - request_rec object
- * db - sqlite database object
- * sessid - session id for this user
+ * Parameters:
+ * data - z_stream
  *
- * Returns: 
- * char*
+ * Returns:
+ * APR_SUCCESS
  */
-static char* csrfp_sql_get_token(request_rec *r, sqlite3 *db, const char *sessid)
+static apr_status_t csrfp_zin_cleanup(void *data)
 {
-    char *result = NULL;
-    sqlite3_stmt *res;
-    const char *tail;
-    const char *sql = apr_psprintf(r->pool, "SELECT token FROM CSRFP WHERE sessid = '%s'", sessid);
-    int rc = sqlite3_prepare_v2(db, sql, 1000, &res, &tail);
-    if (rc != SQLITE_OK) {
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-addn-select-error", tail);
-        #endif
-        return rc;
-    } else {
-        while (sqlite3_step(res) == SQLITE_ROW) {
-            result = strdup((const char*)sqlite3_column_text(res, 0));
+    inflateEnd((z_stream *)data);
+    return APR_SUCCESS;
+}
+
+/*
+ * Function: csrfp_zout_cleanup
+ * Pool cleanup, frees the deflate state of a response
+ *
+ * Parameters:
+ * data - csrfp_gzip_ctx
+ *
+ * Returns:
+ * APR_SUCCESS
+ */
+static apr_status_t csrfp_zout_cleanup(void *data)
+{
+    deflateEnd(&((csrfp_gzip_ctx *)data)->zs);
+    return APR_SUCCESS;
+}
+
+/*
+ * Function: csrfp_gzip_init
+ * Sets up a gzip encoded response for scanning, csrfp_out_filter
+ * inflates it and csrfp_gzip_filter, added after it, compresses the
+ * result again
+ *
+ * Parameters:
+ * r - request_rec object
+ * rctx - Request context
+ *
+ * Returns:
+ * APR_SUCCESS, APR_EGENERAL if zlib could not be set up
+ */
+static apr_status_t csrfp_gzip_init(request_rec *r, csrfp_opf_ctx *rctx)
+{
+    csrfp_gzip_ctx *gctx = apr_pcalloc(r->pool, sizeof(csrfp_gzip_ctx));
+    z_stream *zin = apr_pcalloc(r->pool, sizeof(z_stream));
+
+    // windowBits + 16, gzip header and trailer instead of zlib ones
+    if (inflateInit2(zin, MAX_WBITS + 16) != Z_OK) {
+        return APR_EGENERAL;
+    }
+    apr_pool_cleanup_register(r->pool, zin, csrfp_zin_cleanup, apr_pool_cleanup_null);
+
+    if (deflateInit2(&gctx->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16,
+                    MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return APR_EGENERAL;
+    }
+    apr_pool_cleanup_register(r->pool, gctx, csrfp_zout_cleanup, apr_pool_cleanup_null);
+    gctx->out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+
+    rctx->zin = zin;
+    rctx->zbuf = apr_palloc(r->pool, CSRFP_GZIP_CHUNK_SIZE);
+    ap_add_output_filter("csrfp_gzip_filter", gctx, r, r->connection);
+    return APR_SUCCESS;
+}
+
+/*
+ * Function: csrfp_gunzip
+ * Replaces a data bucket by its inflated content, inserted before it.
+ * The inflate state carries over from bucket to bucket, concatenated
+ * gzip members are inflated one after the other. The caller reads the
+ * bucket, so a generator with nothing ready yet is handled like for
+ * plain responses
+ *
+ * Parameters:
+ * r - request_rec object
+ * b - bucket, deleted once inflated
+ * data - content of b
+ * len - length of data
+ * rctx - Request context
+ *
+ * Returns:
+ * apr_status_t code, APR_EGENERAL if the data is not valid gzip
+ */
+static apr_status_t csrfp_gunzip(request_rec *r, apr_bucket *b, const char *data,
+                                apr_size_t len, csrfp_opf_ctx *rctx)
+{
+    z_stream *zs = rctx->zin;
+    int zrv;
+
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = len;
+    do {
+        apr_size_t n;
+
+        zs->next_out = rctx->zbuf;
+        zs->avail_out = CSRFP_GZIP_CHUNK_SIZE;
+        zrv = inflate(zs, Z_NO_FLUSH);
+        if (zrv != Z_OK && zrv != Z_STREAM_END && zrv != Z_BUF_ERROR) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                "CSRFP unable to inflate gzip response: %s",
+                zs->msg ? zs->msg : "zlib error");
+            return APR_EGENERAL;
+        }
+
+        n = CSRFP_GZIP_CHUNK_SIZE - zs->avail_out;
+        if (n > 0) {
+            APR_BUCKET_INSERT_BEFORE(b, apr_bucket_heap_create((const char *)rctx->zbuf,
+                                        n, NULL, b->list));
+        }
+
+        if (zrv == Z_STREAM_END) {
+            if (zs->avail_in == 0)
+                break;
+            // Another member follows
+            inflateReset(zs);
+        } else if (zrv == Z_BUF_ERROR) {
+            // Needs the next bucket
+            break;
+        }
+    } while (zs->avail_in > 0 || zs->avail_out == 0);
+
+    apr_bucket_delete(b);
+    return APR_SUCCESS;
+}
+
+/*
+ * Function: csrfp_gzip_deflate
+ * Compresses data into the output brigade of csrfp_gzip_filter
+ *
+ * Parameters:
+ * gctx - csrfp_gzip_filter state
+ * data - data to compress, may be NULL when only flushing
+ * len - length of data
+ * flush - zlib flush mode, Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH
+ * out - brigade the compressed data is appended to
+ *
+ * Returns:
+ * APR_SUCCESS, APR_EGENERAL on a zlib error
+ */
+static apr_status_t csrfp_gzip_deflate(csrfp_gzip_ctx *gctx, const char *data,
+                                        apr_size_t len, int flush,
+                                        apr_bucket_brigade *out)
+{
+    z_stream *zs = &gctx->zs;
+    int zrv;
+
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = len;
+    do {
+        apr_size_t n;
+
+        zs->next_out = gctx->buf;
+        zs->avail_out = CSRFP_GZIP_CHUNK_SIZE;
+        zrv = deflate(zs, flush);
+        if (zrv != Z_OK && zrv != Z_STREAM_END && zrv != Z_BUF_ERROR)
+            return APR_EGENERAL;
+
+        n = CSRFP_GZIP_CHUNK_SIZE - zs->avail_out;
+        if (n > 0) {
+            APR_BRIGADE_INSERT_TAIL(out, apr_bucket_heap_create((const char *)gctx->buf,
+                                        n, NULL, out->bucket_alloc));
+        }
+    } while (zs->avail_in > 0 || zs->avail_out == 0);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Function: csrfp_fix_length
+ * Sets the final Content-Length of a response once nothing more will be
+ * injected, or drops it when that can not be known before the headers
+ * are sent (the response is then chunked, or closes the connection)
+ *
+ * Parameters:
+ * r - request_rec object
+ * rctx - Request context
+ * known - non zero if rctx->injected is final
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_fix_length(request_rec *r, csrfp_opf_ctx *rctx, int known)
+{
+    apr_table_unset(r->err_headers_out, "Content-Length");
+    if (known) {
+        ap_set_content_length(r, rctx->origLength + rctx->injected);
+    } else {
+        apr_table_unset(r->headers_out, "Content-Length");
+    }
+    rctx->clstate = modified;
+}
+
+/*
+ * Function: csrfp_etag_derive
+ * Replaces the ETag of a response by the weak one of its injected
+ * version, W/"<opaque tag>-csrfp<hash of the fragments>"
+ *
+ * Parameters:
+ * r - request_rec object
+ * conf - server configuration, holding the ETag suffix
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_etag_derive(request_rec *r, csrfp_config *conf)
+{
+    const char *etag = apr_table_get(r->headers_out, "ETag");
+    apr_size_t slen = strlen(conf->etagSuffix);
+    const char *q, *e;
+
+    if (etag == NULL)
+        return;
+
+    // Derived already, by csrfp_out_filter or csrfp_insert_error_filter
+    if (strlen(etag) >= slen && !strcmp(etag + strlen(etag) - slen, conf->etagSuffix))
+        return;
+
+    // Injected pages are only equivalent to the original, never identical
+    if (!strncmp(etag, "W/", 2))
+        etag += 2;
+    q = strchr(etag, '"');
+    e = strrchr(etag, '"');
+    if (q == NULL || e == q)
+        return;
+
+    apr_table_set(r->headers_out, "ETag", apr_psprintf(r->pool, "W/\"%.*s%s",
+                    (int)(e - q - 1), q + 1, conf->etagSuffix));
+}
+
+/*
+ * Function: csrfp_etag_original
+ * Maps derived ETags in an If-None-Match list back to the ETags the
+ * handler knows. Whether that one was weak is not known, so
+ * W/"<opaque tag>-csrfp<hash>" becomes "<opaque tag>", W/"<opaque tag>"
+ *
+ * Parameters:
+ * p - pool to allocate the result from
+ * inm - value of the If-None-Match header
+ * suffix - ETag suffix of the current fragments
+ *
+ * Returns:
+ * the rewritten list, NULL if it had no derived ETag
+ */
+static const char *csrfp_etag_original(apr_pool_t *p, const char *inm,
+                                        const char *suffix)
+{
+    apr_size_t slen = strlen(suffix);
+    const char *c = inm, *m;
+    char *out, *o;
+
+    if (strstr(inm, suffix) == NULL)
+        return NULL;
+
+    // Each tag at most doubles
+    o = out = apr_palloc(p, 2 * strlen(inm) + 1);
+    while ((m = strstr(c, suffix)) != NULL) {
+        const char *q = m, *t;
+
+        // Opening quote of this tag
+        while (q > c && *(q - 1) != '"')
+            --q;
+        if (q == c) {
+            memcpy(o, c, m + slen - c);
+            o += m + slen - c;
+            c = m + slen;
+            continue;
+        }
+        --q;
+
+        t = (q - c >= 2 && q[-2] == 'W' && q[-1] == '/') ? q - 2 : q;
+        memcpy(o, c, t - c);
+        o += t - c;
+        memcpy(o, q, m - q);
+        o += m - q;
+        memcpy(o, "\", W/", 5);
+        o += 5;
+        memcpy(o, q, m - q);
+        o += m - q;
+        *o++ = '"';
+        c = m + slen;
+    }
+    strcpy(o, c);
+    return out;
+}
+
+/*
+ * Function: csrfp_pass_scanned
+ * Passes the buckets of bb before b to the next filter right away,
+ * what is left (b onwards) stays in bb for scanning
+ *
+ * Parameters:
+ * f - apache filter object
+ * bb - apache brigade object
+ * b - first bucket not to pass, may be the sentinel
+ * rctx - Request context
+ * flush - non zero to append a FLUSH bucket to what is passed
+ *
+ * Returns:
+ * apr_status_t code of ap_pass_brigade
+ */
+static apr_status_t csrfp_pass_scanned(ap_filter_t *f, apr_bucket_brigade *bb,
+                                        apr_bucket *b, csrfp_opf_ctx *rctx, int flush)
+{
+    apr_status_t rv;
+
+    // Headers go out now, before knowing if anything more gets injected
+    if (rctx->clstate == nmodified) {
+        csrfp_fix_length(f->r, rctx, 0);
+    }
+
+    if (rctx->tmpbb == NULL) {
+        rctx->tmpbb = apr_brigade_create(f->r->pool, f->c->bucket_alloc);
+    }
+
+    rctx->tmpbb = apr_brigade_split_ex(bb, b, rctx->tmpbb);
+    if (flush) {
+        APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(f->c->bucket_alloc));
+    }
+
+    rv = ap_pass_brigade(f->next, bb);
+    apr_brigade_cleanup(bb);
+    APR_BRIGADE_CONCAT(bb, rctx->tmpbb);
+    return rv;
+}
+
+/*
+ * Function: logCSRFAttack
+ * Function to log an attack
+ *
+ * Parameters:
+ * r -  request_rec object
+ *
+ * Returns:
+ * void
+ */
+static void logCSRFAttack(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    int isGet = (!strcmp(r->method, "GET"));
+    const char *POSTArgs;   //#todo a way to log POST arguments
+    // Log the failure
+    ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+                      "CSRF ATTACK, %s, action=%d, method=%s, arguments=%s, url=%s%s", 
+                      conf->action == strip ? "strip & served" : "denied",
+                      conf->action,
+                      (isGet)? "GET" : "POST",
+                      (isGet)? r->args: "POSTArgs", //remove ""
+                      "https(s)://",
+                      getCurrentUrl(r));
+}
+
+/*
+ * Function: failedValidationAction
+ * Returns appropriate status code, as per configuration
+ * For failed validation action
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:  
+ * int - status code for action
+ */
+static int failedValidationAction(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    
+    logCSRFAttack(r);   // Log this attack
+
+    switch (conf->action)
+    {
+        case forbidden:
+            return HTTP_FORBIDDEN;
+            break;
+        case strip:
+            // Strip POST values - and forward the request
+            if (!strcmp(r->method, "GET")
+                && r->args) {
+                apr_cpystrn(r->args, "\0", 1);
+            } else if (!strcmp(r->method, "POST")) {
+                ap_discard_request_body(r);
+                apr_table_addn(r->headers_out, "POST_DATA_CLEARING", "reached");
+            }
+            return OK;
+            break;
+        case redirect:
+            // Redirect to custom uri
+            if (strlen(conf->errorRedirectionUri) > 0) {
+                apr_table_add(r->headers_out, "Location", conf->errorRedirectionUri);
+                return HTTP_MOVED_PERMANENTLY;
+            } else {
+                return HTTP_FORBIDDEN;
+            }
+            break;
+        case message:
+            // Show custom Error Message
+            ap_rprintf(r, "<h2>%s</h2>", conf->errorCustomMessage);
+            return DONE;
+            break;
+        case internal_server_error:
+            // Show internel Server error
+            return HTTP_INTERNAL_SERVER_ERROR;
+            break;
+        default:
+            // Default action is FORBIDDEN
+            return HTTP_FORBIDDEN;
+            break;
+    }
+}
+
+/*
+ * Function: storeUnavailableAction
+ * Returns appropriate status code, as per configuration
+ * For requests which could not be validated against the token store
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:  
+ * int - status code for action
+ */
+static int storeUnavailableAction(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    switch (conf->storeFailAction)
+    {
+        case store_accept:
+            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, r,
+                      "CSRFP TOKEN STORE UNAVAILABLE, request accepted without validation");
+            return OK;
+            break;
+        case store_stateless:
+            if (validateTokenStateless(r)) {
+                ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, r,
+                      "CSRFP TOKEN STORE UNAVAILABLE, request validated against token cookie");
+                return OK;
+            }
+            return failedValidationAction(r);
+            break;
+        case store_reject:
+        default:
+            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+                      "CSRFP TOKEN STORE UNAVAILABLE, request rejected");
+            return HTTP_SERVICE_UNAVAILABLE;
             break;
+    }
+}
+
+/*
+ * Function: csrfp_enabled
+ * Function to check the module is enabled for the request's scope
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:
+ * int, 1 if enabled, 0 otherwise
+ */
+static int csrfp_enabled(request_rec *r)
+{
+    csrfp_dir_config *dconf = ap_get_module_config(r->per_dir_config,
+                                                &csrf_protector_module);
+    return (dconf->flag != CSRFP_FALSE);
+}
+
+/*
+ * Function: csrfp_ignored
+ * Function to check the requested path against the ignore rules,
+ * csrfpIgnoreExtensions and csrfpIgnorePrefix
+ *
+ * Parameters: 
+ * dconf - per directory configuration
+ * path - requested path
+ *
+ * Returns: 
+ * int, 1 if the path is ignored, 0 otherwise
+ */
+static int csrfp_ignored(csrfp_dir_config *dconf, const char *path)
+{
+    apr_hash_t *exts = (dconf->ignoreExt != NULL) ? dconf->ignoreExt : csrfp_ignore_default;
+    const char *name, *ext;
+    char key[CSRFP_EXTENSION_MAXLENGTH];
+    apr_size_t len, i;
+
+    // Extension of the last segment, one hash lookup
+    name = strrchr(path, '/');
+    ext = strrchr((name != NULL) ? name : path, '.');
+    if (ext != NULL) {
+        len = strlen(++ext);
+        if (len > 0 && len < CSRFP_EXTENSION_MAXLENGTH) {
+            for (i = 0; i < len; ++i) {
+                key[i] = apr_tolower(ext[i]);
+            }
+            if (apr_hash_get(exts, key, len) != NULL) {
+                return 1;
+            }
+        }
+    }
+
+    for (i = 0; dconf->ignorePrefix && i < (apr_size_t)dconf->ignorePrefix->nelts; ++i) {
+        const char *prefix = APR_ARRAY_IDX(dconf->ignorePrefix, i, const char *);
+        if (!strncmp(path, prefix, strlen(prefix))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: needvalidation
+ * Function to decide weather to validate current request
+ * Depending upon requested file, matched against the ignore rules.
+ * Decided once per request, kept in the request context
+ *
+ * Parameters: 
+ * r - request_rec object
+ *
+ * Returns: 
+ * int, - 1 if validation needed, 0 otherwise
+ */
+static int needvalidation(request_rec *r)
+{
+    csrfp_opf_ctx *rctx = csrfp_get_rctx(r);
+
+    if (rctx->validation == CSRFP_VALIDATION_UNKNOWN) {
+        csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                    &csrf_protector_module);
+
+        rctx->validation = CSRFP_VALIDATION_YES;
+        if (conf->tokenEndpoint && !strcmp(r->uri, conf->tokenEndpoint)) {
+            // Requested for a token, there can not be one yet
+            rctx->validation = CSRFP_VALIDATION_NO;
+        } else if (r->parsed_uri.path
+            && csrfp_ignored(ap_get_module_config(r->per_dir_config, &csrf_protector_module),
+                            r->parsed_uri.path)) {
+            rctx->validation = CSRFP_VALIDATION_NO;
+        }
+    }
+    return (rctx->validation == CSRFP_VALIDATION_YES);
+}
+
+//=============================================================
+// All SQLite related functions
+//=============================================================
+
+/*
+ * Function: csrfp_store_available
+ * Function to check the token store circuit breaker of this child
+ *
+ * Parameters: 
+ * r - request_rec object
+ *
+ * Returns: 
+ * int, 1 if the token store may be used, 0 while the breaker is open
+ */
+static int csrfp_store_available(request_rec *r)
+{
+    apr_uint32_t openUntil = apr_atomic_read32(&csrfp_store_open_until);
+    if (openUntil == 0) return 1;
+
+    // Breaker is open, let requests through again once retry time passed
+    return ((apr_uint32_t)apr_time_sec(apr_time_now()) >= openUntil);
+}
+
+/*
+ * Function: csrfp_store_record
+ * Function to update the circuit breaker with the outcome of a
+ * token store session
+ *
+ * Parameters: 
+ * r - request_rec object
+ * success - 1 if the session succeeded, 0 on error or timeout
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_store_record(request_rec *r, int success)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    if (success) {
+        if (apr_atomic_read32(&csrfp_store_failures))
+            apr_atomic_set32(&csrfp_store_failures, 0);
+        if (apr_atomic_read32(&csrfp_store_open_until))
+            apr_atomic_set32(&csrfp_store_open_until, 0);
+        return;
+    }
+
+    apr_uint32_t failures = apr_atomic_inc32(&csrfp_store_failures) + 1;
+    if (conf->storeFailThreshold > 0
+        && failures >= (apr_uint32_t)conf->storeFailThreshold) {
+        apr_uint32_t openUntil = (apr_uint32_t)apr_time_sec(apr_time_now())
+                                    + conf->storeRetryAfter;
+        apr_atomic_set32(&csrfp_store_open_until, openUntil);
+        if (failures == (apr_uint32_t)conf->storeFailThreshold) {
+            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+                "CSRFP TOKEN STORE FAILED %u TIMES, suspended for %d seconds",
+                failures, conf->storeRetryAfter);
+        }
+    }
+}
+
+/*
+ * Function: csrfp_store_get_budget
+ * Function to get (or create) the token store time budget of a request
+ *
+ * Parameters: 
+ * r - request_rec object
+ *
+ * Returns: 
+ * budget object of this request
+ */
+static csrfp_store_budget *csrfp_store_get_budget(request_rec *r)
+{
+    csrfp_store_budget *budget = NULL;
+    apr_pool_userdata_get((void **)&budget, CSRFP_STORE_BUDGET_KEY, r->pool);
+    if (budget == NULL) {
+        csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+        budget = apr_pcalloc(r->pool, sizeof(csrfp_store_budget));
+        budget->remaining = apr_time_from_msec(conf->storeTimeout);
+        apr_pool_userdata_setn(budget, CSRFP_STORE_BUDGET_KEY, NULL, r->pool);
+    }
+    return budget;
+}
+
+/*
+ * Function: csrfp_sql_busy_handler
+ * SQLite busy handler, retries locked operations until the deadline
+ * of the current store session
+ *
+ * Parameters: 
+ * data - csrfp_store_budget object of the request
+ * count - number of times handler was invoked for this lock
+ *
+ * Returns: 
+ * int, non zero to retry, 0 to give up
+ */
+static int csrfp_sql_busy_handler(void *data, int count)
+{
+    csrfp_store_budget *budget = (csrfp_store_budget *)data;
+    apr_time_t now = apr_time_now();
+
+    if (budget->deadline && now >= budget->deadline) {
+        budget->timedout = 1;
+        return 0;
+    }
+
+    // sqlite3_sleep() rounds up to whole seconds when built without
+    // HAVE_USLEEP, as it is by apxs, so sleep through APR instead
+    apr_interval_time_t wait = apr_time_from_msec((count < 4) ? 1 : 5);
+    if (budget->deadline && now + wait > budget->deadline) {
+        wait = budget->deadline - now;
+    }
+    apr_sleep(wait);
+    return 1;
+}
+
+/*
+ * Function: csrfp_sql_progress_handler
+ * SQLite progress handler, interrupts statements which run past
+ * the deadline of the current store session
+ *
+ * Parameters: 
+ * data - csrfp_store_budget object of the request
+ *
+ * Returns: 
+ * int, non zero to interrupt the statement
+ */
+static int csrfp_sql_progress_handler(void *data)
+{
+    csrfp_store_budget *budget = (csrfp_store_budget *)data;
+    if (apr_time_now() >= budget->deadline) {
+        budget->timedout = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Function: csrfp_sql_timedout
+ * Function to check if a token store operation of this request
+ * ran out of its time budget
+ *
+ * Parameters: 
+ * r - request_rec object
+ *
+ * Returns: 
+ * int, 1 if timed out
+ */
+static int csrfp_sql_timedout(request_rec *r)
+{
+    return csrfp_store_get_budget(r)->timedout;
+}
+
+/*
+ * Function: csrfp_sql_init
+ * Function to initiate the sql process for code validation
+ *
+ * Parameters: 
+ * r - request_rec object
+ *
+ * Returns: 
+ * db, SQLITE database object on success, NULL if the token store
+ * is unavailable or the request's time budget is used up
+ */
+static sqlite3 *csrfp_sql_init(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    if (!csrfp_store_available(r)) {
+        return NULL;
+    }
+
+    csrfp_store_budget *budget = csrfp_store_get_budget(r);
+    budget->opened = apr_time_now();
+    budget->deadline = 0;
+    budget->failed = 0;
+    if (conf->storeTimeout > 0) {
+        if (budget->remaining <= 0) {
+            budget->timedout = 1;
+            return NULL;
+        }
+        budget->deadline = budget->opened + budget->remaining;
+    }
+
+    sqlite3 *db;
+    int useShm = (conf->storeBackend == store_shm && csrfp_shm != NULL);
+    int rc = sqlite3_open_v2(useShm ? CSRFP_SHM_DB_NAME : DATABASE_DEFAULT_LOCATION,
+                    &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                    useShm ? CSRFP_SHM_VFS_NAME : NULL);
+    if (rc != SQLITE_OK) {
+        #ifdef DEBUG
+            apr_table_addn(r->headers_out, "sql-init-open-error", sqlite3_errmsg(db));
+        #endif
+        sqlite3_close(db);
+        budget->remaining -= apr_time_now() - budget->opened;
+        csrfp_store_record(r, 0);
+        return NULL;
+    }
+
+    // Bound lock waits and statement run time by the request's budget
+    sqlite3_busy_handler(db, csrfp_sql_busy_handler, budget);
+    if (budget->deadline) {
+        sqlite3_progress_handler(db, CSRFP_STORE_PROGRESS_OPS,
+                                 csrfp_sql_progress_handler, budget);
+    }
+
+    // Error reporting 
+    char *zErrMsg = 0;
+
+    /* Execute SQL statement */
+    rc = csrfp_store_schema(db, conf->tokenLength, &zErrMsg);
+    if( rc != SQLITE_OK ){
+        #ifdef DEBUG
+            apr_table_addn(r->headers_out, "sql-init-exec-error", apr_pstrdup(r->pool, zErrMsg));
+        #endif
+        sqlite3_free(zErrMsg);
+        goto failed;
+    }
+
+    return db;
+
+    failed:
+    sqlite3_close(db);
+    budget->remaining -= apr_time_now() - budget->opened;
+    csrfp_store_record(r, 0);
+    return NULL;
+}
+
+/*
+ * Function: csrfp_sql_close
+ * Function to close the sql connection, charge its time to the
+ * request's budget and report the outcome to the circuit breaker
+ *
+ * Parameters: 
+ * r - request_rec object
+ * db - sqlite database object, may be NULL
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_sql_close(request_rec *r, sqlite3 *db)
+{
+    if (db == NULL) return;
+
+    sqlite3_close(db);
+
+    csrfp_store_budget *budget = csrfp_store_get_budget(r);
+    budget->remaining -= apr_time_now() - budget->opened;
+    if (budget->timedout) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, r,
+                      "CSRFP TOKEN STORE exceeded time budget");
+    } else if (budget->failed) {
+        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, r,
+                      "CSRFP TOKEN STORE statement failed");
+    }
+    csrfp_store_record(r, !budget->timedout && !budget->failed);
+}
+
+/*
+ * Function: csrfp_sql_error
+ * Function to check the result code of a token store statement, an
+ * error fails the current store session for the circuit breaker
+ *
+ * Parameters: 
+ * r - request_rec object
+ * rc - SQLite result code
+ *
+ * Returns: 
+ * int, 1 if rc is an error
+ */
+static int csrfp_sql_error(request_rec *r, int rc)
+{
+    if (rc == SQLITE_OK || rc == SQLITE_ROW || rc == SQLITE_DONE)
+        return 0;
+
+    csrfp_store_get_budget(r)->failed = 1;
+    return 1;
+}
+
+/*
+ * Function: csrfp_sql_update_counter
+ * Function to add / Update counter value for reseeding
+ *
+ * Parameters: 
+ * r - request_rec object
+ * db - sqlite database object
+ *
+ * Returns: 
+ * integer, current counter
+ */
+static int csrfp_sql_update_counter(request_rec *r, sqlite3 *db)
+{
+    // Check if exist -- true > update, false > insert 1
+    int counter = 1;
+    int shouldUpdate = 0;
+    sqlite3_stmt *res;
+    const char *tail;
+
+    // #todo: you might want to create a seperate pool for this & destroy it later
+    const char *sql = apr_psprintf(r->pool, "SELECT counter FROM CSRFP_COUNTER");
+    int rc = sqlite3_prepare_v2(db, sql, 1000, &res, &tail);
+    if (rc != SQLITE_OK) {
+        #ifdef DEBUG
+            apr_table_addn(r->headers_out, "sql-update-counter-select-error", tail);
+        #endif
+        return rc;
+    } else {
+        while (sqlite3_step(res) == SQLITE_ROW) {
+            counter = atoi(sqlite3_column_text(res, 0));
+            ++shouldUpdate;
+            break;
+        }
+    }
+    sqlite3_reset(res);
+
+    char *zErrMsg = NULL;
+    if (shouldUpdate != 0) {
+        //means entry exist -- update
+        sql = apr_psprintf(r->pool, "UPDATE CSRFP_COUNTER SET counter = counter + 1");
+        rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+        if (rc != SQLITE_OK) {
+            #ifdef DEBUG
+                apr_table_addn(r->headers_out, "sql-update-counter-update-error", zErrMsg);
+            #endif
+            return rc;
+        }
+        counter++;
+    } else {
+        // Insert
+        sql = apr_psprintf(r->pool, "INSERT INTO CSRFP_COUNTER (counter) VALUES (1)");
+        rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
+        if (rc != SQLITE_OK) {
+            #ifdef DEBUG
+                apr_table_addn(r->headers_out, "sql-update-counter-insert-error", zErrMsg);
+            #endif
+            return rc;
+        }
+    }
+    #ifdef DEBUG
+        apr_table_addn(r->headers_out, "sql-update-counter-value", apr_itoa(r->pool, counter));
+    #endif
+    return counter;
+}
+
+/*
+ * Function: csrfp_sql_get_token
+ * Function to get token for session
+ *
+ * Parameters: 
+ * r - request_rec object
+ * db - sqlite database object
+ * sessid - session id for this user
+ *
+ * Returns: 
+ * char*, NULL if the session has no token
+ */
+static char* csrfp_sql_get_token(request_rec *r, sqlite3 *db, const char *sessid)
+{
+    char *result = NULL, *token;
+    int rc = csrfp_store_token(db, sessid, &token);
+    if (rc == SQLITE_ROW) {
+        result = apr_pstrdup(r->pool, token);
+        sqlite3_free(token);
+    } else if (csrfp_sql_error(r, rc)) {
+        #ifdef DEBUG
+            apr_table_addn(r->headers_out, "sql-addn-select-error", sqlite3_errmsg(db));
+        #endif
+    }
+    return result;
+}
+
+/*
+ * Function: csrfp_sql_addn
+ * Function to add / Update token value in the db
+ *
+ * Parameters: 
+ * r - request_rec object
+ * db - sqlite database object
+ * sessid - session id for this user
+ * value-  value of the token
+ *
+ * Returns: 
+ * integer, SQLITE_OK on success
+ */
+static int csrfp_sql_addn(request_rec *r, sqlite3 *db, const char *sessid, const char *value)
+{
+    // sessid of value cannot be null
+    if (sessid == NULL || value == NULL)
+        return -1;
+
+    int rc = csrfp_store_put(db, sessid, value, (sqlite3_int64)time(NULL));
+    if (rc != SQLITE_OK) {
+        #ifdef DEBUG
+            apr_table_addn(r->headers_out, "sql-addn-insert-error", sqlite3_errmsg(db));
+        #endif
+    }
+    return rc;
+}
+
+/*
+ * Funciton: csrfp_sql_match
+ * Function to match value in db to value sent as param
+ *
+ * Parameters: 
+ * r - request_rec object
+ * db - sqlite database object
+ * sessid - session id for this user
+ * value - value to match
+ * rc - set to the SQLite result code, SQLITE_OK unless a statement failed
+ *
+ * Returns: 
+ * 0 for correct match
+ */
+static int csrfp_sql_match(request_rec *r, sqlite3 *db, const char *sessid, const char *value,
+                            int *rc)
+{
+    *rc = SQLITE_OK;
+
+    // sessid of value cannot be null
+    if (sessid == NULL || value == NULL)
+        return -1;
+
+    sqlite3_int64 timestamp = (sqlite3_int64)time(NULL), issued;
+    int step = csrfp_store_match(db, sessid, value, &issued);
+
+    if (step == SQLITE_ROW) {
+        if (timestamp > issued + TOKEN_EXPIRY_MAXTIME) {
+            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+                    "CSRFP csrfp_sql_match return -1");
+            return -1;
+        }
+        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+            "CSRFP csrfp_sql_match return 0");
+        return 0;
+    }
+    if (step != SQLITE_DONE) {
+        // The store failed to answer, this is no verdict on the token
+        #ifdef DEBUG
+            apr_table_addn(r->headers_out, "sql-match-select-error", sqlite3_errmsg(db));
+        #endif
+        *rc = step;
+        return 1;
+    }
+    ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+          "CSRFP csrfp_sql_match return 1");
+    return 1;
+}
+
+/*
+ * Function: csrfp_sql_table_clean
+ * Function to clear expired tokens from db
+ *
+ * Parameters: 
+ * r - request_rec object
+ * db - sqlite database object
+ *
+ * Returns: 
+ * void
+ */
+
+static void csrfp_sql_table_clean(request_rec *r, sqlite3 *db)
+{
+    char *zErrMsg = NULL;
+    int rc = csrfp_store_expire(db, (sqlite3_int64)time(NULL) - TOKEN_EXPIRY_MAXTIME,
+                                &zErrMsg);
+    if (rc != SQLITE_OK) {
+        #ifdef DEBUG
+            apr_table_addn(r->headers_out, "sql-clean-error", apr_pstrdup(r->pool, zErrMsg));
+        #endif
+        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
+            "CSRFP cleaning %s.", zErrMsg);
+        sqlite3_free(zErrMsg);
+    }
+}
+/*
+ * Function: csrfp_get_rule_match
+ * Function to match current url against the verifyGetFor rules
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:
+ * matching rule node, NULL if no rule matches
+ */
+static struct getRuleNode *csrfp_get_rule_match(request_rec *r)
+{
+    csrfp_dir_config *dconf = ap_get_module_config(r->per_dir_config,
+                                                &csrf_protector_module);
+    return csrfp_url_rule_match(r, dconf->rules, getCurrentUrl(r));
+}
+
+/*
+ * Function: csrfp_rules_exec
+ * Function to match a url against rules one by one
+ *
+ * Parameters:
+ * rules - struct getRuleNode * array
+ * currentUrl - url with http:// scheme
+ * currentUrlSecure - url with https:// scheme
+ *
+ * Returns:
+ * first matching rule node, NULL if no rule matches
+ */
+static struct getRuleNode *csrfp_rules_exec(apr_array_header_t *rules,
+                        const char *currentUrl, const char *currentUrlSecure)
+{
+    struct getRuleNode *p;
+    int i;
+
+    for (i = 0; i < rules->nelts; ++i) {
+        p = APR_ARRAY_IDX(rules, i, struct getRuleNode *);
+        if (ap_regexec(p->pattern, currentUrl, 0, NULL, 0) == 0
+            || ap_regexec(p->pattern, currentUrlSecure, 0, NULL, 0) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: csrfp_prefix_match
+ * Function to match a url against the indexed rules. The trie is
+ * walked from the start of the host, and from after every other
+ * "://" in the url, which is where an unanchored rule can match
+ * too. Only rules whose whole prefix is found get their regex run
+ *
+ * Parameters:
+ * r - request_rec object
+ * rules - compiled rules
+ * url - host and path, without scheme and query
+ * currentUrl - url with http:// scheme
+ * currentUrlSecure - url with https:// scheme
+ *
+ * Returns:
+ * matching rule node, NULL if no indexed rule matches
+ */
+static struct getRuleNode *csrfp_prefix_match(request_rec *r, csrfp_rule_set *rules,
+                        const char *url, const char *currentUrl,
+                        const char *currentUrlSecure)
+{
+    csrfp_prefix_node *active[2][CSRFP_PREFIX_ACTIVE_MAX], *n;
+    struct getRuleNode *p;
+    const char *start, *c;
+    int nactive, nnext, i, cur;
+
+    for (start = url; start != NULL; start = (start = strstr(start, "://")) ? start + 3 : NULL) {
+        cur = 0;
+        active[cur][0] = rules->index;
+        nactive = 1;
+
+        for (c = start; nactive > 0; ++c) {
+            // Every rule whose prefix ended here is a candidate
+            for (i = 0; i < nactive; ++i) {
+                if (active[cur][i]->rules != NULL) {
+                    p = csrfp_rules_exec(active[cur][i]->rules, currentUrl, currentUrlSecure);
+                    if (p != NULL)
+                        return p;
+                }
+            }
+            if (*c == '\0')
+                break;
+
+            nnext = 0;
+            for (i = 0; i < nactive; ++i) {
+                for (n = active[cur][i]->child; n != NULL; n = n->next) {
+                    if (n->c != *c && n->c != '\0')
+                        continue;
+                    if (nnext == CSRFP_PREFIX_ACTIVE_MAX) {
+                        // Too many wildcards at once, check them all
+                        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                            "CSRFP verifyGetFor index overflow, matching indexed rules one by one");
+                        return csrfp_rules_exec(rules->indexed, currentUrl, currentUrlSecure);
+                    }
+                    active[!cur][nnext++] = n;
+                }
+            }
+            cur = !cur;
+            nactive = nnext;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: csrfp_url_rule_match
+ * Function to match a url of this site against the verifyGetFor rules
+ *
+ * Parameters:
+ * r - request_rec object
+ * rules - compiled rules, NULL if there are none
+ * url - host and path, without scheme and query
+ *
+ * Returns:
+ * matching rule node, NULL if no rule matches
+ */
+static struct getRuleNode *csrfp_url_rule_match(request_rec *r, csrfp_rule_set *rules,
+                                                const char *url)
+{
+    struct getRuleNode *p;
+    if (rules == NULL) return NULL;
+
+    const char *currentUrl = apr_pstrcat(r->pool, "http://", url, NULL);
+    const char *currentUrlSecure = apr_pstrcat(r->pool, "https://", url, NULL);
+
+    // A newline in the url would split it in the combined subject
+    if (strchr(url, '\n') != NULL) {
+        return csrfp_rules_exec(rules->all, currentUrl, currentUrlSecure);
+    }
+
+    // Only the indexed rules whose prefix is in the url
+    if (rules->index != NULL) {
+        p = csrfp_prefix_match(r, rules, url, currentUrl, currentUrlSecure);
+        if (p != NULL) {
+            return p;
+        }
+    }
+
+    // One pass for all combined rules, one line per scheme
+    if (rules->combined != NULL) {
+        ap_regmatch_t *m = apr_palloc(r->pool, rules->ngroups * sizeof(ap_regmatch_t));
+        const char *subject = apr_pstrcat(r->pool, currentUrl, "\n", currentUrlSecure, NULL);
+        apr_size_t g;
+
+        if (ap_regexec(rules->combined, subject, rules->ngroups, m, 0) == 0) {
+            for (g = 1; g < rules->ngroups; ++g) {
+                if (rules->groups[g] != NULL && m[g].rm_so != -1) {
+                    return rules->groups[g];
+                }
+            }
+        }
+    }
+
+    return csrfp_rules_exec(rules->single, currentUrl, currentUrlSecure);
+}
+
+/*
+ * Function: csrfp_rule_combinable
+ * Function to check a verifyGetFor rule can be part of the combined
+ * alternation. Rules with backreferences, group numbers or recursion
+ * would change meaning, and rules with anything that can match a
+ * newline (negated classes, \s, \D, ...) could match across the two
+ * lines of the subject
+ *
+ * Parameters:
+ * pattern - rule as given in the configuration
+ *
+ * Returns:
+ * int, 1 if it can be combined, 0 if it is matched on its own
+ */
+static int csrfp_rule_combinable(const char *pattern)
+{
+    const char *c;
+
+    for (c = pattern; *c; ++c) {
+        if (c[0] == '\\') {
+            if (c[1] == '\0')
+                return 0;
+            if (apr_isupper(c[1]) || apr_isdigit(c[1]) || strchr("gksnvzxcre", c[1]))
+                return 0;
+            ++c;
+        } else if (c[0] == '[' && c[1] == '^') {
+            return 0;
+        } else if (c[0] == '(' && c[1] == '?'
+            && c[2] != ':' && c[2] != '=' && c[2] != '!' && c[2] != 'i') {
+            return 0;
+        } else if (c[0] == '(' && c[1] == '?' && c[2] == 'i' && c[3] != ')' && c[3] != ':') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Function: csrfp_rule_prefix
+ * Function to get the literal host and path prefix of a verifyGetFor
+ * rule, the part right after "://" which any url it matches has.
+ * Only rules starting with an optional '^', one of .*, https?, https,
+ * http and then "://", and without a top level '|' have one
+ *
+ * Parameters:
+ * pattern - rule as given in the configuration
+ * prefix - buffer of CSRFP_PREFIX_MAXLENGTH bytes, '\0' for '.'
+ *
+ * Returns:
+ * length of prefix, 0 if the rule can not be indexed
+ */
+static apr_size_t csrfp_rule_prefix(const char *pattern, char *prefix)
+{
+    static const char *schemes[] = { ".*", "https?", "https", "http", NULL };
+    const char *c = pattern;
+    apr_size_t n = 0;
+    int depth = 0, i;
+    char ch;
+
+    // Alternatives would not all have the prefix
+    for (c = pattern; *c; ++c) {
+        if (*c == '\\' && c[1] != '\0') {
+            // \Q..\E could quote a '|' or a parenthesis
+            if (*++c == 'Q')
+                return 0;
+        } else if (*c == '[') {
+            // ']' right after '[' or '[^' is part of the class
+            if (*++c == '^')
+                ++c;
+            if (*c == ']')
+                ++c;
+            while (*c && *c != ']')
+                c += (*c == '\\' && c[1] != '\0') ? 2 : 1;
+            if (*c == '\0')
+                return 0;
+        } else if (*c == '(') {
+            ++depth;
+        } else if (*c == ')') {
+            --depth;
+        } else if (*c == '|' && depth == 0) {
+            return 0;
+        }
+    }
+
+    c = pattern;
+    if (*c == '^')
+        ++c;
+    for (i = 0; schemes[i] != NULL; ++i) {
+        if (!strncmp(c, schemes[i], strlen(schemes[i]))) {
+            c += strlen(schemes[i]);
+            break;
+        }
+    }
+    if (!strncmp(c, "://", 3))
+        c += 3;
+    else if (!strncmp(c, ":\\/\\/", 5))
+        c += 5;
+    else
+        return 0;
+
+    while (*c && n < CSRFP_PREFIX_MAXLENGTH) {
+        if (*c == '\\' && c[1] != '\0' && strchr("./-_~:%@=&,;!", c[1])) {
+            ch = c[1];
+            c += 2;
+        } else if (*c == '.') {
+            ch = '\0';
+            c += 1;
+        } else if (apr_isalnum(*c) || strchr("/-_~:%@=&,;!'<>", *c)) {
+            ch = *c;
+            c += 1;
+        } else {
+            break;
+        }
+
+        // Quantified, this character may not be there
+        if (*c == '*' || *c == '?' || *c == '{') {
+            break;
+        }
+        prefix[n++] = ch;
+        if (*c == '+')
+            break;
+    }
+    return n;
+}
+
+/*
+ * Function: csrfp_prefix_add
+ * Function to add the prefix of a rule to the trie
+ *
+ * Parameters:
+ * p - configuration pool
+ * root - root of the trie
+ * prefix - prefix from csrfp_rule_prefix
+ * len - length of prefix
+ * rule - rule node
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_prefix_add(apr_pool_t *p, csrfp_prefix_node *root,
+                            const char *prefix, apr_size_t len,
+                            struct getRuleNode *rule)
+{
+    csrfp_prefix_node *node = root, *n;
+    apr_size_t i;
+
+    for (i = 0; i < len; ++i) {
+        for (n = node->child; n != NULL && n->c != prefix[i]; n = n->next)
+            ;
+        if (n == NULL) {
+            n = apr_pcalloc(p, sizeof(csrfp_prefix_node));
+            n->c = prefix[i];
+            n->next = node->child;
+            node->child = n;
+        }
+        node = n;
+    }
+    if (node->rules == NULL) {
+        node->rules = apr_array_make(p, 1, sizeof(struct getRuleNode *));
+    }
+    APR_ARRAY_PUSH(node->rules, struct getRuleNode *) = rule;
+}
+
+/*
+ * Function: csrfp_rules_build
+ * Function to index the verifyGetFor rules by their literal prefix,
+ * and to compile the others into one alternation,
+ * ( rule1 )|( rule2 )|..., matched against "http://url\nhttps://url".
+ * The capture group that took part in the match tells the rule
+ *
+ * Parameters:
+ * p - configuration pool
+ * s - server_rec object
+ * rules - rule set to compile, with the rules in all
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_rules_build(apr_pool_t *p, server_rec *s, csrfp_rule_set *rules)
+{
+    apr_array_header_t *list = rules->all;
+    struct getRuleNode *rule;
+    apr_array_header_t *combined = apr_array_make(p, 8, sizeof(struct getRuleNode *));
+    char *pattern = NULL;
+    char prefix[CSRFP_PREFIX_MAXLENGTH];
+    apr_size_t ngroups = 1, len;
+    int i;
+
+    rules->single = apr_array_make(p, 2, sizeof(struct getRuleNode *));
+    rules->indexed = apr_array_make(p, 8, sizeof(struct getRuleNode *));
+
+    for (i = 0; i < list->nelts; ++i) {
+        rule = APR_ARRAY_IDX(list, i, struct getRuleNode *);
+        if ((len = csrfp_rule_prefix(rule->patternString, prefix)) > 0) {
+            // Run only for urls with the prefix
+            if (rules->index == NULL) {
+                rules->index = apr_pcalloc(p, sizeof(csrfp_prefix_node));
+            }
+            csrfp_prefix_add(p, rules->index, prefix, len, rule);
+            APR_ARRAY_PUSH(rules->indexed, struct getRuleNode *) = rule;
+        } else if (csrfp_rule_combinable(rule->patternString)) {
+            APR_ARRAY_PUSH(combined, struct getRuleNode *) = rule;
+            pattern = apr_pstrcat(p, pattern ? pattern : "", pattern ? "|(" : "(",
+                                    rule->patternString, ")", NULL);
+            ngroups += 1 + rule->pattern->re_nsub;
+        } else {
+            APR_ARRAY_PUSH(rules->single, struct getRuleNode *) = rule;
+        }
+    }
+    if (pattern == NULL)
+        return;
+
+    // '^' and '$' at the start and end of each line, as for each url alone
+    rules->combined = ap_pregcomp(p, pattern, AP_REG_NEWLINE);
+    if (rules->combined == NULL || rules->combined->re_nsub + 1 != ngroups) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "CSRFP unable to combine verifyGetFor rules, matching them one by one");
+        rules->combined = NULL;
+        for (i = 0; i < combined->nelts; ++i) {
+            APR_ARRAY_PUSH(rules->single, struct getRuleNode *) =
+                APR_ARRAY_IDX(combined, i, struct getRuleNode *);
+        }
+        return;
+    }
+
+    rules->ngroups = ngroups;
+    rules->groups = apr_pcalloc(p, ngroups * sizeof(struct getRuleNode *));
+    ngroups = 1;
+    for (i = 0; i < combined->nelts; ++i) {
+        rule = APR_ARRAY_IDX(combined, i, struct getRuleNode *);
+        rules->groups[ngroups] = rule;
+        ngroups += 1 + rule->pattern->re_nsub;
+    }
+}
+
+//=====================================================================
+// Shared memory SQLite VFS -- keeps the token database in csrfp_shm
+//=====================================================================
+
+/*
+ * Function: csrfp_shm_parent_vfs
+ * Returns the default VFS, used for every file which is not the
+ * token database (temporary files)
+ */
+static sqlite3_vfs *csrfp_shm_parent_vfs(sqlite3_vfs *vfs)
+{
+    return (sqlite3_vfs *)vfs->pAppData;
+}
+
+/*
+ * Function: csrfp_shm_is_ours
+ * Checks if a file name refers to the database in shared memory or
+ * to one of its journals, only the rollback journal is kept there
+ */
+static int csrfp_shm_is_ours(const char *zName)
+{
+    return (zName != NULL
+        && !strncmp(zName, CSRFP_SHM_DB_NAME, sizeof(CSRFP_SHM_DB_NAME) - 1));
+}
+
+/*
+ * Function: csrfp_shm_close
+ * sqlite3_io_methods.xClose, drops any lock still held
+ */
+static int csrfp_shm_close(sqlite3_file *pFile)
+{
+    pFile->pMethods->xUnlock(pFile, SQLITE_LOCK_NONE);
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_shm_read
+ * sqlite3_io_methods.xRead, copies pages out of the segment
+ */
+static int csrfp_shm_read(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+    csrfp_shm_file *f = (csrfp_shm_file *)pFile;
+    sqlite3_int64 size = apr_atomic_read32(f->size);
+
+    if (iOfst + iAmt <= size) {
+        memcpy(zBuf, f->data + iOfst, iAmt);
+        return SQLITE_OK;
+    }
+
+    // Short read, SQLite expects the missing part zero filled
+    int avail = (iOfst < size) ? (int)(size - iOfst) : 0;
+    if (avail > 0) {
+        memcpy(zBuf, f->data + iOfst, avail);
+    }
+    memset((char *)zBuf + avail, 0, iAmt - avail);
+    return SQLITE_IOERR_SHORT_READ;
+}
+
+/*
+ * Function: csrfp_shm_write
+ * sqlite3_io_methods.xWrite, copies pages into the segment. A full
+ * journal fails the transaction, which SQLite then rolls back
+ */
+static int csrfp_shm_write(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite3_int64 iOfst)
+{
+    csrfp_shm_file *f = (csrfp_shm_file *)pFile;
+
+    if (iOfst + iAmt > f->capacity) {
+        return SQLITE_FULL;
+    }
+    memcpy(f->data + iOfst, zBuf, iAmt);
+    if (iOfst + iAmt > apr_atomic_read32(f->size)) {
+        apr_atomic_set32(f->size, (apr_uint32_t)(iOfst + iAmt));
+    }
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_shm_truncate
+ * sqlite3_io_methods.xTruncate
+ */
+static int csrfp_shm_truncate(sqlite3_file *pFile, sqlite3_int64 size)
+{
+    csrfp_shm_file *f = (csrfp_shm_file *)pFile;
+    if (size < apr_atomic_read32(f->size)) {
+        apr_atomic_set32(f->size, (apr_uint32_t)size);
+    }
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_shm_sync
+ * sqlite3_io_methods.xSync, nothing to flush in memory. Writes of a
+ * process that dies stay in the segment, the journal written before
+ * the database pages is enough to roll them back
+ */
+static int csrfp_shm_sync(sqlite3_file *pFile, int flags)
+{
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_shm_file_size
+ * sqlite3_io_methods.xFileSize
+ */
+static int csrfp_shm_file_size(sqlite3_file *pFile, sqlite3_int64 *pSize)
+{
+    csrfp_shm_file *f = (csrfp_shm_file *)pFile;
+    *pSize = apr_atomic_read32(f->size);
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_shm_lock
+ * sqlite3_io_methods.xLock, every lock level above NONE is the one
+ * csrfp_shm_mutex, readers wait for each other too. Token statements
+ * are short, and the lock can not outlive a child killed holding it
+ */
+static int csrfp_shm_lock(sqlite3_file *pFile, int eLock)
+{
+    csrfp_shm_file *f = (csrfp_shm_file *)pFile;
+
+    if (f->lock >= eLock) {
+        return SQLITE_OK;
+    }
+
+    if (f->lock == SQLITE_LOCK_NONE) {
+        apr_status_t rv = apr_global_mutex_trylock(csrfp_shm_mutex);
+        if (APR_STATUS_IS_EBUSY(rv)) {
+            // busy handler waits and retries, bounded by the budget
+            return SQLITE_BUSY;
+        }
+        if (rv != APR_SUCCESS) {
+            return SQLITE_IOERR_LOCK;
+        }
+    }
+
+    f->lock = eLock;
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_shm_unlock
+ * sqlite3_io_methods.xUnlock
+ */
+static int csrfp_shm_unlock(sqlite3_file *pFile, int eLock)
+{
+    csrfp_shm_file *f = (csrfp_shm_file *)pFile;
+
+    if (f->lock <= eLock) {
+        return SQLITE_OK;
+    }
+
+    if (eLock == SQLITE_LOCK_NONE
+        && apr_global_mutex_unlock(csrfp_shm_mutex) != APR_SUCCESS) {
+        return SQLITE_IOERR_UNLOCK;
+    }
+
+    f->lock = eLock;
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_shm_check_reserved
+ * sqlite3_io_methods.xCheckReservedLock, while this handle holds the
+ * mutex no other one can be writing
+ */
+static int csrfp_shm_check_reserved(sqlite3_file *pFile, int *pResOut)
+{
+    csrfp_shm_file *f = (csrfp_shm_file *)pFile;
+
+    if (f->lock != SQLITE_LOCK_NONE) {
+        *pResOut = (f->lock >= SQLITE_LOCK_RESERVED);
+        return SQLITE_OK;
+    }
+
+    apr_status_t rv = apr_global_mutex_trylock(csrfp_shm_mutex);
+    if (rv == APR_SUCCESS) {
+        apr_global_mutex_unlock(csrfp_shm_mutex);
+    }
+    *pResOut = (rv != APR_SUCCESS);
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_shm_file_control
+ * sqlite3_io_methods.xFileControl, no custom operations
+ */
+static int csrfp_shm_file_control(sqlite3_file *pFile, int op, void *pArg)
+{
+    return SQLITE_NOTFOUND;
+}
+
+/*
+ * Function: csrfp_shm_sector_size
+ * sqlite3_io_methods.xSectorSize
+ */
+static int csrfp_shm_sector_size(sqlite3_file *pFile)
+{
+    return CSRFP_SQL_PAGE_SIZE;
+}
+
+/*
+ * Function: csrfp_shm_device_characteristics
+ * sqlite3_io_methods.xDeviceCharacteristics
+ */
+static int csrfp_shm_device_characteristics(sqlite3_file *pFile)
+{
+    return SQLITE_IOCAP_SEQUENTIAL | SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+}
+
+static const sqlite3_io_methods csrfp_shm_io_methods = {
+    1,                                  // iVersion
+    csrfp_shm_close,
+    csrfp_shm_read,
+    csrfp_shm_write,
+    csrfp_shm_truncate,
+    csrfp_shm_sync,
+    csrfp_shm_file_size,
+    csrfp_shm_lock,
+    csrfp_shm_unlock,
+    csrfp_shm_check_reserved,
+    csrfp_shm_file_control,
+    csrfp_shm_sector_size,
+    csrfp_shm_device_characteristics,
+    NULL,                               // xShmMap, version 2, no WAL
+    NULL,                               // xShmLock
+    NULL,                               // xShmBarrier
+    NULL,                               // xShmUnmap
+    NULL,                               // xFetch, version 3, no mmap
+    NULL                                // xUnfetch
+};
+
+/*
+ * Function: csrfp_shm_open
+ * sqlite3_vfs.xOpen, the main database and its rollback journal are
+ * served from the segment, anything else (temporary files) goes to
+ * the default VFS
+ */
+static int csrfp_shm_open(sqlite3_vfs *vfs, const char *zName, sqlite3_file *pFile,
+                            int flags, int *pOutFlags)
+{
+    if (!csrfp_shm_is_ours(zName)) {
+        sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+        return parent->xOpen(parent, zName, pFile, flags, pOutFlags);
+    }
+
+    // No WAL or statement journals here, journal_mode stays DELETE
+    if (!(flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL))
+        || csrfp_shm == NULL || csrfp_shm_mutex == NULL) {
+        pFile->pMethods = NULL;
+        return SQLITE_CANTOPEN;
+    }
+
+    csrfp_shm_file *f = (csrfp_shm_file *)pFile;
+    f->hdr = (csrfp_shm_header *)apr_shm_baseaddr_get(csrfp_shm);
+    if (f->hdr->magic != CSRFP_SHM_MAGIC) {
+        pFile->pMethods = NULL;
+        return SQLITE_CANTOPEN;
+    }
+    f->data = (char *)f->hdr + APR_ALIGN_DEFAULT(sizeof(csrfp_shm_header));
+    if (flags & SQLITE_OPEN_MAIN_DB) {
+        f->size = &f->hdr->size;
+        f->capacity = f->hdr->capacity;
+    } else {
+        f->data += f->hdr->capacity;
+        f->size = &f->hdr->journalSize;
+        f->capacity = f->hdr->journalCapacity;
+    }
+    f->lock = SQLITE_LOCK_NONE;
+    f->base.pMethods = &csrfp_shm_io_methods;
+    if (pOutFlags) {
+        *pOutFlags = flags;
+    }
+    return SQLITE_OK;
+}
+
+/*
+ * Function: csrfp_shm_delete
+ * sqlite3_vfs.xDelete, an empty journal is a deleted one
+ */
+static int csrfp_shm_delete(sqlite3_vfs *vfs, const char *zName, int syncDir)
+{
+    if (csrfp_shm_is_ours(zName)) {
+        if (!strcmp(zName, CSRFP_SHM_JOURNAL_NAME) && csrfp_shm != NULL) {
+            csrfp_shm_header *hdr = (csrfp_shm_header *)apr_shm_baseaddr_get(csrfp_shm);
+            apr_atomic_set32(&hdr->journalSize, 0);
+        }
+        return SQLITE_OK;
+    }
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    return parent->xDelete(parent, zName, syncDir);
+}
+
+/*
+ * Function: csrfp_shm_access
+ * sqlite3_vfs.xAccess, the journal exists while it is not empty. One
+ * left by a child that died mid transaction is rolled back by the
+ * next connection (hot journal)
+ */
+static int csrfp_shm_access(sqlite3_vfs *vfs, const char *zName, int flags, int *pResOut)
+{
+    if (csrfp_shm_is_ours(zName)) {
+        csrfp_shm_header *hdr = (csrfp_shm != NULL)
+                                ? (csrfp_shm_header *)apr_shm_baseaddr_get(csrfp_shm) : NULL;
+        *pResOut = 0;
+        if (hdr != NULL && !strcmp(zName, CSRFP_SHM_DB_NAME)) {
+            *pResOut = 1;
+        } else if (hdr != NULL && !strcmp(zName, CSRFP_SHM_JOURNAL_NAME)) {
+            *pResOut = (apr_atomic_read32(&hdr->journalSize) > 0);
+        }
+        return SQLITE_OK;
+    }
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    return parent->xAccess(parent, zName, flags, pResOut);
+}
+
+/*
+ * Function: csrfp_shm_full_pathname
+ * sqlite3_vfs.xFullPathname, shm database name is kept as is
+ */
+static int csrfp_shm_full_pathname(sqlite3_vfs *vfs, const char *zName, int nOut, char *zOut)
+{
+    if (csrfp_shm_is_ours(zName)) {
+        sqlite3_snprintf(nOut, zOut, "%s", zName);
+        return SQLITE_OK;
+    }
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    return parent->xFullPathname(parent, zName, nOut, zOut);
+}
+
+/*
+ * Functions: csrfp_shm_dl_*, csrfp_shm_randomness, csrfp_shm_sleep,
+ * csrfp_shm_current_time, csrfp_shm_last_error
+ * Forwarded to the default VFS
+ */
+static void *csrfp_shm_dl_open(sqlite3_vfs *vfs, const char *zPath)
+{
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    return parent->xDlOpen(parent, zPath);
+}
+
+static void csrfp_shm_dl_error(sqlite3_vfs *vfs, int nByte, char *zErrMsg)
+{
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    parent->xDlError(parent, nByte, zErrMsg);
+}
+
+static void (*csrfp_shm_dl_sym(sqlite3_vfs *vfs, void *pH, const char *z))(void)
+{
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    return parent->xDlSym(parent, pH, z);
+}
+
+static void csrfp_shm_dl_close(sqlite3_vfs *vfs, void *pHandle)
+{
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    parent->xDlClose(parent, pHandle);
+}
+
+static int csrfp_shm_randomness(sqlite3_vfs *vfs, int nByte, char *zOut)
+{
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    return parent->xRandomness(parent, nByte, zOut);
+}
+
+static int csrfp_shm_sleep(sqlite3_vfs *vfs, int microseconds)
+{
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    return parent->xSleep(parent, microseconds);
+}
+
+static int csrfp_shm_current_time(sqlite3_vfs *vfs, double *pTime)
+{
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    return parent->xCurrentTime(parent, pTime);
+}
+
+static int csrfp_shm_last_error(sqlite3_vfs *vfs, int nBuf, char *zBuf)
+{
+    sqlite3_vfs *parent = csrfp_shm_parent_vfs(vfs);
+    return parent->xGetLastError(parent, nBuf, zBuf);
+}
+
+static sqlite3_vfs csrfp_shm_vfs = {
+    1,                                  // iVersion
+    0,                                  // szOsFile, set at registration
+    0,                                  // mxPathname, set at registration
+    NULL,                               // pNext
+    CSRFP_SHM_VFS_NAME,                 // zName
+    NULL,                               // pAppData, default VFS
+    csrfp_shm_open,
+    csrfp_shm_delete,
+    csrfp_shm_access,
+    csrfp_shm_full_pathname,
+    csrfp_shm_dl_open,
+    csrfp_shm_dl_error,
+    csrfp_shm_dl_sym,
+    csrfp_shm_dl_close,
+    csrfp_shm_randomness,
+    csrfp_shm_sleep,
+    csrfp_shm_current_time,
+    csrfp_shm_last_error,
+    NULL,                               // xCurrentTimeInt64, version 2
+    NULL,                               // xSetSystemCall, version 3
+    NULL,                               // xGetSystemCall
+    NULL                                // xNextSystemCall
+};
+
+/*
+ * Function: csrfp_shm_create
+ * Function to create the shared memory segment for the token store,
+ * called in the parent so all children inherit the mapping
+ *
+ * Parameters: 
+ * p - configuration pool, segment lives as long as it
+ * s - server_rec object
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_shm_create(apr_pool_t *p, server_rec *s)
+{
+    csrfp_config *conf = ap_get_module_config(s->module_config,
+                                                &csrf_protector_module);
+    csrfp_shm = NULL;
+    csrfp_shm_mutex = NULL;
+    if (conf->storeBackend != store_shm) {
+        return;
+    }
+
+    apr_status_t rv = apr_shm_create(&csrfp_shm, conf->storeShmSize, NULL, p);
+    if (rv != APR_SUCCESS) {
+        csrfp_shm = NULL;
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to create shared memory token store, "
+                     "using %s instead", DATABASE_DEFAULT_LOCATION);
+        return;
+    }
+
+    rv = apr_global_mutex_create(&csrfp_shm_mutex, NULL, CSRFP_SHM_LOCK_MECH, p);
+#ifdef AP_NEED_SET_MUTEX_PERMS
+    if (rv == APR_SUCCESS) {
+        rv = unixd_set_global_mutex_perms(csrfp_shm_mutex);
+    }
+#endif
+    if (rv != APR_SUCCESS) {
+        csrfp_shm = NULL;
+        csrfp_shm_mutex = NULL;
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to create shared memory token store lock, "
+                     "using %s instead", DATABASE_DEFAULT_LOCATION);
+        return;
+    }
+
+    // Half of the segment for the rollback journal, a transaction
+    // touching every page of the database still fits
+    csrfp_shm_header *hdr = (csrfp_shm_header *)apr_shm_baseaddr_get(csrfp_shm);
+    apr_size_t offset = APR_ALIGN_DEFAULT(sizeof(csrfp_shm_header));
+    apr_size_t avail = apr_shm_size_get(csrfp_shm) - offset;
+    hdr->magic = CSRFP_SHM_MAGIC;
+    hdr->size = 0;
+    hdr->capacity = (apr_uint32_t)((avail / 2) & ~(apr_size_t)(CSRFP_SQL_PAGE_SIZE - 1));
+    hdr->journalSize = 0;
+    hdr->journalCapacity = (apr_uint32_t)(avail - hdr->capacity);
+}
+
+/*
+ * Function: csrfp_shm_child_init
+ * Function to reopen the shm store lock in a child
+ *
+ * Parameters: 
+ * p - child pool
+ * s - server_rec object
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_shm_child_init(apr_pool_t *p, server_rec *s)
+{
+    if (csrfp_shm == NULL || csrfp_shm_mutex == NULL) {
+        return;
+    }
+
+    apr_status_t rv = apr_global_mutex_child_init(&csrfp_shm_mutex,
+                                apr_global_mutex_lockfile(csrfp_shm_mutex), p);
+    if (rv != APR_SUCCESS) {
+        // Without its lock the segment is not safe to use
+        csrfp_shm = NULL;
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to open shared memory token store lock, "
+                     "using %s instead", DATABASE_DEFAULT_LOCATION);
+    }
+}
+
+/*
+ * Function: csrfp_shm_vfs_register
+ * Function to register the shared memory VFS with SQLite, once
+ * SQLite has been configured for this process
+ *
+ * Parameters: 
+ * s - server_rec object
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_shm_vfs_register(server_rec *s)
+{
+    if (csrfp_shm == NULL) {
+        return;
+    }
+
+    sqlite3_vfs *parent = sqlite3_vfs_find(NULL);
+    if (parent == NULL) {
+        return;
+    }
+    csrfp_shm_vfs.pAppData = parent;
+    csrfp_shm_vfs.mxPathname = parent->mxPathname;
+    csrfp_shm_vfs.szOsFile = (parent->szOsFile > (int)sizeof(csrfp_shm_file))
+                                ? parent->szOsFile : (int)sizeof(csrfp_shm_file);
+
+    int rc = sqlite3_vfs_register(&csrfp_shm_vfs, 0);
+    if (rc != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "CSRFP unable to register shared memory VFS (%d)", rc);
+    }
+}
+
+//=====================================================================
+// Token snapshot -- carries the shm token store across restarts
+//=====================================================================
+
+/*
+ * Function: csrfp_snapshot_db
+ * Function to open the shared memory token database from the parent
+ *
+ * Parameters: 
+ * s - server_rec object
+ * budget - time budget for lock waits, kept by caller
+ *
+ * Returns: 
+ * db, SQLITE database object, NULL on failure
+ */
+static sqlite3 *csrfp_snapshot_db(server_rec *s, csrfp_store_budget *budget)
+{
+    csrfp_config *conf = ap_get_module_config(s->module_config,
+                                                &csrf_protector_module);
+    sqlite3 *db;
+    char *zErrMsg = NULL;
+
+    int rc = sqlite3_open_v2(CSRFP_SHM_DB_NAME, &db,
+                    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, CSRFP_SHM_VFS_NAME);
+    if (rc != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "CSRFP snapshot unable to open token store: %s",
+                     sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    budget->timedout = 0;
+    budget->opened = apr_time_now();
+    budget->deadline = budget->opened + apr_time_from_msec(CSRFP_SNAPSHOT_TIMEOUT);
+    sqlite3_busy_handler(db, csrfp_sql_busy_handler, budget);
+
+    rc = csrfp_store_schema(db, conf->tokenLength, &zErrMsg);
+    if (rc != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "CSRFP snapshot unable to prepare token store: %s", zErrMsg);
+        sqlite3_free(zErrMsg);
+        sqlite3_close(db);
+        return NULL;
+    }
+    return db;
+}
+
+/*
+ * Function: csrfp_snapshot_save
+ * Pool cleanup run in the parent when the configuration pool goes away
+ * (restart, graceful or stop). Writes the live sessions of the shm
+ * token store to conf->snapshotFile, through a temporary file renamed
+ * in place so a crash never leaves a torn snapshot
+ *
+ * Parameters: 
+ * data - server_rec object
+ *
+ * Returns: 
+ * APR_SUCCESS
+ */
+static apr_status_t csrfp_snapshot_save(void *data)
+{
+    server_rec *s = (server_rec *)data;
+    csrfp_config *conf = ap_get_module_config(s->module_config,
+                                                &csrf_protector_module);
+    if (getpid() != csrfp_snapshot_pid || csrfp_shm == NULL) {
+        return APR_SUCCESS;
+    }
+
+    // Configuration pool is being cleared, work in a pool of our own
+    apr_pool_t *p;
+    if (apr_pool_create(&p, NULL) != APR_SUCCESS) {
+        return APR_SUCCESS;
+    }
+
+    csrfp_store_budget budget;
+    sqlite3 *db = csrfp_snapshot_db(s, &budget);
+    if (db == NULL) {
+        apr_pool_destroy(p);
+        return APR_SUCCESS;
+    }
+
+    const char *tmp = apr_pstrcat(p, conf->snapshotFile, ".tmp", NULL);
+    apr_file_t *f = NULL;
+    apr_status_t rv = apr_file_open(&f, tmp,
+                        APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_TRUNCATE
+                        | APR_FOPEN_BUFFERED | APR_FOPEN_BINARY,
+                        APR_FPROT_UREAD | APR_FPROT_UWRITE, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to create token snapshot %s", tmp);
+        sqlite3_close(db);
+        apr_pool_destroy(p);
+        return APR_SUCCESS;
+    }
+
+    csrfp_snapshot_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CSRFP_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.written = (apr_int64_t)time(NULL);
+    rv = apr_file_write_full(f, &hdr, sizeof(hdr), NULL);
+
+    // Expired sessions would be cleaned right away, leave them behind
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db, "SELECT sessid, token, timestamp FROM CSRFP"
+                                " WHERE timestamp >= ?", -1, &stmt, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, hdr.written - TOKEN_EXPIRY_MAXTIME);
+        while (rv == APR_SUCCESS && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            csrfp_snapshot_record rec;
+            int sessidLength = sqlite3_column_bytes(stmt, 0);
+            int tokenLength = sqlite3_column_bytes(stmt, 1);
+            if (sessidLength > 0xFFFF || tokenLength > 0xFFFF)
+                continue;
+
+            memset(&rec, 0, sizeof(rec));
+            rec.timestamp = sqlite3_column_int64(stmt, 2);
+            rec.sessidLength = (apr_uint16_t)sessidLength;
+            rec.tokenLength = (apr_uint16_t)tokenLength;
+            rv = apr_file_write_full(f, &rec, sizeof(rec), NULL);
+            if (rv == APR_SUCCESS)
+                rv = apr_file_write_full(f, sqlite3_column_text(stmt, 0),
+                                         sessidLength, NULL);
+            if (rv == APR_SUCCESS)
+                rv = apr_file_write_full(f, sqlite3_column_text(stmt, 1),
+                                         tokenLength, NULL);
+            hdr.count++;
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(db);
+
+    if (rv == APR_SUCCESS && rc == SQLITE_DONE) {
+        apr_off_t offset = 0;
+        rv = apr_file_seek(f, APR_SET, &offset);
+        if (rv == APR_SUCCESS)
+            rv = apr_file_write_full(f, &hdr, sizeof(hdr), NULL);
+    }
+    apr_status_t crv = apr_file_close(f);
+
+    if (rv != APR_SUCCESS || crv != APR_SUCCESS || rc != SQLITE_DONE) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, (rv != APR_SUCCESS) ? rv : crv, s,
+                     "CSRFP unable to write token snapshot %s (%d)", tmp, rc);
+        apr_file_remove(tmp, p);
+    } else if ((rv = apr_file_rename(tmp, conf->snapshotFile, p)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to rename token snapshot to %s", conf->snapshotFile);
+        apr_file_remove(tmp, p);
+    } else {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                     "CSRFP saved %u sessions to %s", hdr.count, conf->snapshotFile);
+    }
+
+    apr_pool_destroy(p);
+    return APR_SUCCESS;
+}
+
+/*
+ * Function: csrfp_snapshot_load
+ * Function to fill a freshly created shm token store from the snapshot
+ * written at the last shutdown. The file is memory mapped and every
+ * session not yet expired is inserted in a single transaction
+ *
+ * Parameters: 
+ * p - temporary pool
+ * s - server_rec object
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_snapshot_load(apr_pool_t *p, server_rec *s)
+{
+    csrfp_config *conf = ap_get_module_config(s->module_config,
+                                                &csrf_protector_module);
+    apr_file_t *f;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+
+    apr_status_t rv = apr_file_open(&f, conf->snapshotFile,
+                                    APR_FOPEN_READ | APR_FOPEN_BINARY, 0, p);
+    if (rv != APR_SUCCESS) {
+        // No snapshot yet, first start
+        return;
+    }
+
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f);
+    if (rv != APR_SUCCESS || finfo.size < (apr_off_t)sizeof(csrfp_snapshot_header)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                     "CSRFP ignoring token snapshot %s, too short", conf->snapshotFile);
+        apr_file_close(f);
+        return;
+    }
+
+    rv = apr_mmap_create(&mm, f, 0, (apr_size_t)finfo.size, APR_MMAP_READ, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+                     "CSRFP unable to map token snapshot %s", conf->snapshotFile);
+        apr_file_close(f);
+        return;
+    }
+
+    const char *pos = (const char *)mm->mm;
+    const char *end = pos + mm->size;
+    csrfp_snapshot_header hdr;
+    memcpy(&hdr, pos, sizeof(hdr));
+    pos += sizeof(hdr);
+    if (memcmp(hdr.magic, CSRFP_SNAPSHOT_MAGIC, sizeof(hdr.magic))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "CSRFP ignoring token snapshot %s, bad format", conf->snapshotFile);
+        apr_mmap_delete(mm);
+        apr_file_close(f);
+        return;
+    }
+
+    csrfp_store_budget budget;
+    sqlite3 *db = csrfp_snapshot_db(s, &budget);
+    sqlite3_stmt *stmt = NULL;
+    if (db == NULL
+        || sqlite3_exec(db, "BEGIN", 0, 0, NULL) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO CSRFP (sessid, token, timestamp)"
+                              " VALUES (?, ?, ?)", -1, &stmt, NULL) != SQLITE_OK) {
+        if (db != NULL) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "CSRFP unable to load token snapshot: %s", sqlite3_errmsg(db));
+            sqlite3_close(db);
+        }
+        apr_mmap_delete(mm);
+        apr_file_close(f);
+        return;
+    }
+
+    apr_int64_t expired = (apr_int64_t)time(NULL) - TOKEN_EXPIRY_MAXTIME;
+    apr_uint32_t i, loaded = 0;
+    int rc = SQLITE_OK;
+    for (i = 0; i < hdr.count && rc == SQLITE_OK; i++) {
+        csrfp_snapshot_record rec;
+        if (end - pos < (apr_off_t)sizeof(rec))
+            break;
+        memcpy(&rec, pos, sizeof(rec));
+        pos += sizeof(rec);
+        if (end - pos < (apr_off_t)rec.sessidLength + rec.tokenLength)
+            break;
+
+        if (rec.timestamp >= expired) {
+            sqlite3_bind_text(stmt, 1, pos, rec.sessidLength, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, pos + rec.sessidLength, rec.tokenLength,
+                              SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 3, rec.timestamp);
+            rc = sqlite3_step(stmt);
+            rc = (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+            sqlite3_reset(stmt);
+            loaded++;
+        }
+        pos += rec.sessidLength + rec.tokenLength;
+    }
+    sqlite3_finalize(stmt);
+
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(db, "COMMIT", 0, 0, NULL);
+    }
+    if (rc != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "CSRFP unable to load token snapshot: %s", sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", 0, 0, NULL);
+    } else {
+        if (i < hdr.count) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                         "CSRFP token snapshot %s truncated after %u records",
+                         conf->snapshotFile, i);
+        }
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                     "CSRFP restored %u sessions from %s", loaded, conf->snapshotFile);
+    }
+    sqlite3_close(db);
+    apr_mmap_delete(mm);
+    apr_file_close(f);
+}
+
+/*
+ * Function: csrfp_snapshot_init
+ * Function to restore the snapshot into a new shm token store and
+ * arrange for the store to be saved again when this generation of
+ * the configuration ends
+ *
+ * Parameters: 
+ * pconf - configuration pool
+ * ptemp - temporary pool
+ * s - server_rec object
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_snapshot_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s)
+{
+    csrfp_config *conf = ap_get_module_config(s->module_config,
+                                                &csrf_protector_module);
+    if (conf->snapshotFile == NULL || csrfp_shm == NULL) {
+        return;
+    }
+
+    csrfp_snapshot_load(ptemp, s);
+
+    // Registered after the segment's own cleanup, so runs before it
+    csrfp_snapshot_pid = getpid();
+    apr_pool_cleanup_register(pconf, s, csrfp_snapshot_save, apr_pool_cleanup_null);
+}
+
+/*
+ * Function: csrfp_sql_shutdown
+ * Pool cleanup, releases SQLite before its arenas are freed
+ *
+ * Parameters: 
+ * data - unused
+ *
+ * Returns: 
+ * APR_SUCCESS
+ */
+static apr_status_t csrfp_sql_shutdown(void *data)
+{
+    sqlite3_shutdown();
+    return APR_SUCCESS;
+}
+
+/*
+ * Function: csrfp_sql_configure
+ * Function to configure SQLite library for this child process, must
+ * be called before any database is opened in the child.
+ * Sets up a preallocated page cache arena and lookaside allocator
+ * sized for the CSRFP tables, turns off global memory statistics and
+ * matches the threading mode to the MPM
+ *
+ * Parameters: 
+ * p - child pool
+ * s - server_rec object
+ *
+ * Returns: 
+ * void
+ */
+static void csrfp_sql_configure(apr_pool_t *p, server_rec *s)
+{
+    int threaded = 0;
+    int rc;
+
+    // Parent may have used the library already, config needs it uninitialised
+    sqlite3_shutdown();
+
+    // Connections are never shared between threads, so no need of
+    // serialized mode; a non threaded MPM does not need mutexes at all
+    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) != APR_SUCCESS)
+        threaded = AP_MPMQ_STATIC;
+    rc = sqlite3_config((threaded != AP_MPMQ_NOT_SUPPORTED)
+                        ? SQLITE_CONFIG_MULTITHREAD : SQLITE_CONFIG_SINGLETHREAD);
+    if (rc != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "CSRFP unable to set SQLite threading mode (%d)", rc);
+    }
+
+    // Memory statistics take a global mutex on every allocation
+    sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 0);
+
+    // Page cache arena, pages come from here instead of malloc
+    void *pagecache = apr_palloc(p, CSRFP_SQL_PAGECACHE_SLOT * CSRFP_SQL_PAGECACHE_SLOTS);
+    rc = sqlite3_config(SQLITE_CONFIG_PAGECACHE, pagecache,
+                        CSRFP_SQL_PAGECACHE_SLOT, CSRFP_SQL_PAGECACHE_SLOTS);
+    if (rc != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "CSRFP unable to set SQLite page cache (%d)", rc);
+    }
+
+    // Default lookaside for every connection opened in this child
+    sqlite3_config(SQLITE_CONFIG_LOOKASIDE,
+                   CSRFP_SQL_LOOKASIDE_SLOT, CSRFP_SQL_LOOKASIDE_SLOTS);
+
+    rc = sqlite3_initialize();
+    if (rc != SQLITE_OK) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "CSRFP unable to initialize SQLite (%d)", rc);
+        return;
+    }
+
+    apr_pool_cleanup_register(p, NULL, csrfp_sql_shutdown, apr_pool_cleanup_null);
+}
+
+//=====================================================================
+// Handlers -- call back functions for different hooks
+//=====================================================================
+/*
+ * Function: csrfp_header_parser
+ * Callback function for header parser by Hook Registering function
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Return:
+ * status code, int
+ */
+static int csrfp_header_parser(request_rec *r)
+{
+    if (!csrfp_enabled(r))
+        return OK;
+
+    // Subrequests (SSI includes, DirectoryIndex lookups) are part of the
+    // main request, which is validated itself
+    if (r->main != NULL)
+        return OK;
+
+    // Tells csrfp_token_filter the request was not answered by a quick handler
+    apr_table_setn(r->notes, CSRFP_CHECKED_NOTE, "1");
+
+    // Internal redirect (ErrorDocument, mod_rewrite) of a request whose
+    // token passed the check, carry the outcome over. A request that was
+    // ignored or needed no check says nothing about the new uri
+    if (r->prev != NULL && apr_table_get(r->prev->notes, CSRFP_VALIDATED_NOTE)) {
+        apr_table_setn(r->notes, CSRFP_VALIDATED_NOTE, "1");
+        if (apr_table_get(r->prev->subprocess_env, "regen_csrfptoken")) {
+            apr_table_setn(r->subprocess_env, "regen_csrfptoken", CSRFP_REGEN_TOKEN);
+            apr_table_setn(r->subprocess_env, "mod_csrfp_enabled", "true");
+            apr_table_addn(r->headers_out, "X-Protected-By", CSRFP_NAME_VERSION);
+        }
+        return OK;
+    }
+
+    if (!needvalidation(r)) {
+        // No need of validation, go ahead!
+        return OK;
+    }
+
+    // If request type is POST
+    // Need to check configs weather or not a validation is needed POST
+    // For GET, validation is needed if url matches one of the rules
+    if ( !strcmp(r->method, "POST")
+        || ( !strcmp(r->method, "GET") && csrfp_get_rule_match(r) )) {
+
+        // Start the sql connection, only when a token has to be checked
+        sqlite3 *db = csrfp_sql_init(r);
+        int rc = SQLITE_OK;
+        int valid = (db != NULL) && validateToken(r, db, &rc);
+        int storeFailed = (db == NULL) || csrfp_sql_error(r, rc) || csrfp_sql_timedout(r);
+
+        // Close the sql connection
+        csrfp_sql_close(r, db);
+
+        if (!valid) {
+            int status;
+            if (storeFailed) {
+                // Token store could not answer, degrade as configured
+                status = storeUnavailableAction(r);
+            } else {
+                // Log this -- [x]
+                // Take actions as per configuration
+                status = failedValidationAction(r);
+            }
+            if (status != OK)
+                return status;
+        } else {
+            apr_table_setn(r->notes, CSRFP_VALIDATED_NOTE, "1");
+        }
+    }
+
+    // Information for output_filter to regenrate token and
+    // append it to output header -- Regenrate token
+    // Section to regenrate and send new Cookie Header (csrfp_token) to client
+    apr_table_add(r->subprocess_env, "regen_csrfptoken", CSRFP_REGEN_TOKEN);
+
+    // Add environment variable for php to inform request has been
+    //      validated by mod_csrfp
+    apr_table_add(r->subprocess_env, "mod_csrfp_enabled", "true");
+
+    // Appends X-Protected-By header to output header
+    apr_table_addn(r->headers_out, "X-Protected-By", CSRFP_NAME_VERSION);
+    return OK;
+}
+
+/*
+ * Function: csrfp_out_filter
+ * Filters output generated by content generator and modify content
+ *
+ * Parameters:
+ * f - apache filter object
+ * bb - apache brigade object
+ *
+ * Returns:
+ * apr_status_t code
+ */
+static apr_status_t csrfp_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    request_rec *r = f->r;
+
+    // csrfp_insert_filter already left out requests that need no validation
+    // Get the context config
+    csrfp_opf_ctx *rctx = csrfp_get_rctx(r);
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    /*
+     * - Determine if it's html and force chunked response
+     * - search <body to insert <noscript> .. </noscript> info
+     * - search </body> to insert script
+     * - set csrfp_token cookie
+     * - end (all done)
+     */
+    if(rctx->state == op_init) {
+        const char *type = getOutputContentType(r);
+        const char *enc = apr_table_get(r->headers_out, "Content-Encoding");
+        int gzip = 0;
+
+        if (enc == NULL) {
+            enc = apr_table_get(r->err_headers_out, "Content-Encoding");
+        }
+        if (enc != NULL) {
+            gzip = !strcasecmp(enc, "gzip") || !strcasecmp(enc, "x-gzip");
+        }
+
+        // Revalidated with the ETag of the injected page, send that one back
+        if (r->status == HTTP_NOT_MODIFIED && apr_table_get(r->notes, CSRFP_ETAG_NOTE)) {
+            csrfp_etag_derive(r, conf);
+        }
+
+        if(r->status == HTTP_NO_CONTENT || r->status == HTTP_NOT_MODIFIED
+            || type == NULL || ( strncasecmp(type, "text/html", 9) != 0
+            && strncasecmp(type, "text/xhtml", 10) != 0)
+            || (enc != NULL && !gzip && strcasecmp(enc, "identity") != 0)
+            || (gzip && csrfp_gzip_init(r, rctx) != APR_SUCCESS) ) {
+            // we don't want to parse this response (no body, no html or
+            // an encoding that can not be scanned)
+            rctx->state = op_end;
+            rctx->nsearch = 0;
+            ap_remove_output_filter(f);
+        } else {
+            // start searching head/body to inject our script
+            csrfp_etag_derive(r, conf);
+
+            // Let the client fetch the script while it parses the page
+            if (conf->jsLink != NULL) {
+                apr_table_addn(r->headers_out, "Link", conf->jsLink);
+            }
+
+            if (conf->rewriteForms == CSRFP_TRUE) {
+                csrfp_rewrite_init(r, rctx);
+            }
+
+            // -- need to modify the Content-Length header
+            if (rctx->zin != NULL) {
+                // Compressed length of the new content is not known before the end
+                csrfp_fix_length(r, rctx, 0);
+            } else if(CSRFP_CHUNKED_ONLY) {
+                // send as chunked response
+                apr_table_unset(r->headers_out, "Content-Length");
+                apr_table_unset(r->err_headers_out, "Content-Length");
+                r->chunked = 1;
+                rctx->clstate = modified;  // Content-Length need not be modified anymore
+            } else {
+                /**
+                 * The length is only adjusted by csrfp_fix_length once it is known
+                 * what gets injected, markers may as well not be there.
+                 * Without a Content-Length there is nothing to fix, the core
+                 * content length filter counts it if the body comes in one brigade
+                 */
+                const char* cl =  apr_table_get(r->headers_out, "Content-Length");
+                if(!cl) {
+                    cl =  apr_table_get(r->err_headers_out, "Content-Length");
+                }
+
+                char *errp = NULL;
+                if(!cl) {
+                    rctx->clstate = modified;
+                } else if(apr_strtoff(&rctx->origLength, cl, &errp, 10) != APR_SUCCESS
+                    || *errp != '\0' || rctx->origLength < 0) {
+                    // fallback to chunked
+                    csrfp_fix_length(r, rctx, 0);
+                }
+            }
+        }
+    }
+
+    // Scanned as plain html, csrfp_gzip_filter compresses it again.
+    // Buckets from raw on are still compressed, they are inflated as the
+    // scan reaches them, so what is scanned can go out while waiting
+    apr_bucket *raw = (rctx->zin != NULL) ? APR_BRIGADE_FIRST(bb) : NULL;
+
+    // start searching within this brigade...
+    if (rctx->nsearch) {
+        apr_bucket *b = APR_BRIGADE_FIRST(bb);
+
+        // Data held back by the previous call goes first, it is scanned already
+        if (rctx->holdbb != NULL) {
+            APR_BRIGADE_PREPEND(bb, rctx->holdbb);
+        }
+
+        while (b != APR_BRIGADE_SENTINEL(bb) && rctx->nsearch) {
+            if (b == raw && APR_BUCKET_IS_METADATA(b)) {
+                raw = APR_BUCKET_NEXT(b);
+            }
+
+            if (APR_BUCKET_IS_FLUSH(b)) {
+                // Upstream wants everything up to here on the wire now
+                apr_status_t rv = csrfp_pass_scanned(f, bb, APR_BUCKET_NEXT(b), rctx, 0);
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+                b = APR_BRIGADE_FIRST(bb);
+                continue;
+            }
+
+            if (!(APR_BUCKET_IS_METADATA(b))) {
+                const char *buf = NULL;
+                apr_size_t nbytes, offset;
+                apr_status_t rv = APR_SUCCESS;
+                int found = 0;
+
+                /**
+                 * Buckets are scanned in place, csrfp_scan keeps the state of a
+                 * '<head ..>', '<body ... >' or '</body>' tag split over buckets in rctx.
+                 * File buckets are read through a scratch buffer and stay file
+                 * buckets, split only where content is injected, so the core
+                 * output filter can still sendfile them
+                 */
+                if (APR_BUCKET_IS_FILE(b) && b != raw) {
+                    nbytes = b->length;
+                } else {
+                    rv = apr_bucket_read(b, &buf, &nbytes, APR_NONBLOCK_READ);
+                    if (APR_STATUS_IS_EAGAIN(rv)) {
+                        // Generator (cgi, proxy) has nothing yet, send what has been
+                        // scanned so the client is not held back, then wait for it
+                        rv = csrfp_pass_scanned(f, bb, b, rctx, 1);
+                        if (rv != APR_SUCCESS) {
+                            return rv;
+                        }
+                        rv = apr_bucket_read(b, &buf, &nbytes, APR_BLOCK_READ);
+                    }
+                    if (rv != APR_SUCCESS) {
+                        return rv;
+                    }
+                }
+
+                if (b == raw) {
+                    // Inflated in place, scanning goes on with its content
+                    apr_bucket *prev = APR_BUCKET_PREV(b);
+                    raw = APR_BUCKET_NEXT(b);
+                    rv = csrfp_gunzip(r, b, buf, nbytes, rctx);
+                    if (rv != APR_SUCCESS) {
+                        return rv;
+                    }
+                    b = APR_BUCKET_NEXT(prev);
+                    continue;
+                }
+
+                if (nbytes > 0) {
+                    // Never scan past csrfpScanLimit
+                    if (conf->scanLimit > 0
+                        && (apr_off_t)nbytes > conf->scanLimit - rctx->scanned) {
+                        nbytes = (apr_size_t)(conf->scanLimit - rctx->scanned);
+                    }
+
+                    if (buf == NULL) {
+                        rv = csrfp_scan_file(r, rctx, b, nbytes, &offset, &found);
+                        if (rv != APR_SUCCESS) {
+                            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r,
+                                "CSRFP unable to read file bucket, injection incomplete");
+                            rctx->nsearch = 0;
+                            break;
+                        }
+                    } else {
+                        found = csrfp_scan(rctx, buf, nbytes, &offset);
+                    }
+
+                    if (found) {
+                        rctx->scanned += offset;
+                        // continue with the data after the injected content
+                        b = (rctx->matched >= marker_form)
+                                ? csrfp_rewrite(r, b, rctx, offset)
+                                : csrfp_inject(r, bb, b, rctx, offset);
+                        continue;
+                    }
+                    rctx->scanned += nbytes;
+
+                    if (conf->scanLimit > 0 && rctx->scanned >= conf->scanLimit) {
+                        // <noscript> went out but the <script> did not, the
+                        // forms of this page will fail validation
+                        ap_log_rerror(APLOG_MARK,
+                            (rctx->state == op_body_init) ? APLOG_WARNING : APLOG_DEBUG, 0, r,
+                            "CSRFP scan limit of %" APR_OFF_T_FMT " bytes reached, "
+                            "injection incomplete", conf->scanLimit);
+                        rctx->nsearch = 0;
+                        break;
+                    }
+                }
+            }
+            b = APR_BUCKET_NEXT(b);
+        }
+    }
+
+    // Past the scan, the rest is only inflated for csrfp_gzip_filter
+    while (raw != NULL && raw != APR_BRIGADE_SENTINEL(bb)) {
+        apr_bucket *b = raw;
+        const char *buf;
+        apr_size_t nbytes;
+        apr_status_t rv;
+
+        raw = APR_BUCKET_NEXT(b);
+        if (APR_BUCKET_IS_METADATA(b)) {
+            continue;
+        }
+
+        rv = apr_bucket_read(b, &buf, &nbytes, APR_NONBLOCK_READ);
+        if (APR_STATUS_IS_EAGAIN(rv)) {
+            rv = csrfp_pass_scanned(f, bb, b, rctx, 1);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            rv = apr_bucket_read(b, &buf, &nbytes, APR_BLOCK_READ);
+        }
+        if (rv == APR_SUCCESS) {
+            rv = csrfp_gunzip(r, b, buf, nbytes, rctx);
+        }
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    if (rctx->clstate == nmodified && rctx->state != op_end) {
+        apr_off_t len = -1;
+
+        if (rctx->nsearch == 0
+            || (!APR_BRIGADE_EMPTY(bb) && APR_BUCKET_IS_EOS(APR_BRIGADE_LAST(bb)))) {
+            // Nothing more will be injected, the length is exact
+            csrfp_fix_length(r, rctx, 1);
+        } else if (apr_brigade_length(bb, 0, &len) == APR_SUCCESS
+            && len >= 0 && len < CSRFP_LENGTH_HOLD_MAX) {
+            // Hold on to the response until the injection is done or it ends
+            apr_bucket *e;
+            for (e = APR_BRIGADE_FIRST(bb); e != APR_BRIGADE_SENTINEL(bb);
+                    e = APR_BUCKET_NEXT(e)) {
+                apr_bucket_setaside(e, r->pool);
+            }
+            if (rctx->holdbb == NULL) {
+                rctx->holdbb = apr_brigade_create(r->pool, f->c->bucket_alloc);
+            }
+            APR_BRIGADE_CONCAT(rctx->holdbb, bb);
+            return APR_SUCCESS;
+        } else {
+            csrfp_fix_length(r, rctx, 0);
+        }
+    }
+
+    if (rctx->nsearch == 0 && rctx->state != op_end) {
+        // All injected or scan limit reached, rest of the response
+        // goes straight through, still inflated for csrfp_gzip_filter
+        // if it is gzip encoded
+        rctx->state = op_end;
+        if (rctx->zin == NULL) {
+            ap_remove_output_filter(f);
+        }
+    }
+    return ap_pass_brigade(f->next, bb);
+}
+
+/*
+ * Function: csrfp_gzip_filter
+ * Filters the output, compresses a gzip response csrfp_out_filter
+ * inflated. Flushes are kept, so streamed pages still stream
+ *
+ * Parameters:
+ * f - apache filter object
+ * bb - apache brigade object
+ *
+ * Returns:
+ * apr_status_t code
+ */
+static apr_status_t csrfp_gzip_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    csrfp_gzip_ctx *gctx = f->ctx;
+    apr_bucket_brigade *out = gctx->out;
+    apr_status_t rv = APR_SUCCESS;
+
+    while (!APR_BRIGADE_EMPTY(bb) && rv == APR_SUCCESS) {
+        apr_bucket *b = APR_BRIGADE_FIRST(bb);
+
+        if (APR_BUCKET_IS_EOS(b)) {
+            rv = csrfp_gzip_deflate(gctx, NULL, 0, Z_FINISH, out);
+            APR_BUCKET_REMOVE(b);
+            APR_BRIGADE_INSERT_TAIL(out, b);
+            ap_remove_output_filter(f);
+        } else if (APR_BUCKET_IS_FLUSH(b)) {
+            rv = csrfp_gzip_deflate(gctx, NULL, 0, Z_SYNC_FLUSH, out);
+            APR_BUCKET_REMOVE(b);
+            APR_BRIGADE_INSERT_TAIL(out, b);
+            if (rv == APR_SUCCESS) {
+                rv = ap_pass_brigade(f->next, out);
+                apr_brigade_cleanup(out);
+            }
+        } else if (APR_BUCKET_IS_METADATA(b)) {
+            APR_BUCKET_REMOVE(b);
+            APR_BRIGADE_INSERT_TAIL(out, b);
+        } else {
+            const char *data;
+            apr_size_t len;
+
+            rv = apr_bucket_read(b, &data, &len, APR_BLOCK_READ);
+            if (rv == APR_SUCCESS) {
+                rv = csrfp_gzip_deflate(gctx, data, len, Z_NO_FLUSH, out);
+            }
+            apr_bucket_delete(b);
+        }
+    }
+
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, f->r,
+                      "CSRFP unable to compress gzip response");
+        return rv;
+    }
+    if (APR_BRIGADE_EMPTY(out)) {
+        return APR_SUCCESS;
+    }
+    rv = ap_pass_brigade(f->next, out);
+    apr_brigade_cleanup(out);
+    return rv;
+}
+
+/*
+ * Function: csrfp_token_filter
+ * Filters the output, sets the token cookies. Runs after CACHE_SAVE
+ * so the cookies are never stored with a cached page, and on cache
+ * hits too, which skip csrfp_out_filter and the fixups
+ *
+ * Parameters:
+ * f - apache filter object
+ * bb - apache brigade object
+ *
+ * Returns:
+ * apr_status_t code
+ */
+static apr_status_t csrfp_token_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    request_rec *r = f->r;
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    const char *regenToken = apr_table_get(r->subprocess_env, "regen_csrfptoken");
+
+    // Once per response, headers go out with the first brigade
+    ap_remove_output_filter(f);
+
+    // Added by csrfp_quick_handler, before the directory was known
+    if (!csrfp_enabled(r))
+        return ap_pass_brigade(f->next, bb);
+
+    // Cache hit, per_dir_config is still the server's. When sections of
+    // the server set csrfpEnable or ignore rules, the page may be in one
+    // of them, no token is issued
+    if (!apr_table_get(r->notes, CSRFP_CHECKED_NOTE) && conf->scoped)
+        return ap_pass_brigade(f->next, bb);
+
+    // Served without the fixups (mod_cache), the token is still due
+    // csrfp_out_filter may have set it already for csrfpRewriteForms
+    if (((regenToken && !strcasecmp(regenToken, CSRFP_REGEN_TOKEN))
+        || (!apr_table_get(r->notes, CSRFP_CHECKED_NOTE) && needvalidation(r)))
+        && !apr_table_get(r->notes, CSRFP_TOKEN_NOTE)) {
+        /*
+         * - Regenrate token
+         * - Send it as output header
+         */
+        if (csrfp_issue_token(r) != NULL) {
+            // Body can be shared by caches downstream, the cookies can not
+            apr_table_mergen(r->headers_out, "Cache-Control", "no-cache=\"Set-Cookie\"");
+        }
+    }
+
+    return ap_pass_brigade(f->next, bb);
+}
+
+/*
+ * Function: csrfp_js_minify
+ * Conservative minification, drops indentation, blank lines and lines
+ * which are only comments. Line breaks are kept so automatic semicolon
+ * insertion still sees the same code, a last line without one gets none
+ *
+ * Parameters:
+ * in - js source
+ * len - length of in
+ * out - buffer of at least len bytes
+ *
+ * Returns:
+ * length of out, apr_size_t
+ */
+static apr_size_t csrfp_js_minify(const char *in, apr_size_t len, char *out)
+{
+    const char *end = in + len, *line, *eol, *e;
+    char *o = out;
+    int comment = 0;
+
+    for (line = in; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+
+        e = eol;
+        while (line < e && (*line == ' ' || *line == '\t'))
+            ++line;
+        while (e > line && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r'))
+            --e;
+
+        if (!comment && e - line >= 2 && line[0] == '/' && line[1] == '*') {
+            comment = 1;
+            line += 2;
+        }
+        if (comment) {
+            const char *c;
+            for (c = line; c + 1 < e && !(c[0] == '*' && c[1] == '/'); ++c)
+                ;
+            if (c + 1 >= e)
+                continue;
+            // code after the end of the comment stays
+            comment = 0;
+            line = c + 2;
+            while (line < e && (*line == ' ' || *line == '\t'))
+                ++line;
+        }
+
+        if (line == e || (e - line >= 2 && line[0] == '/' && line[1] == '/'))
+            continue;
+
+        memcpy(o, line, e - line);
+        o += e - line;
+        // Never more than in, the newline is one of the source
+        if (eol < end)
+            *o++ = '\n';
+    }
+    return o - out;
+}
+
+/*
+ * Function: csrfp_js_load
+ * Loads csrfpJsFile of a server, keeps it minified and gzip encoded
+ * and names its versioned url after a hash of the content
+ *
+ * Parameters:
+ * p - configuration pool
+ * s - server_rec object
+ *
+ * Returns:
+ * void, the script stays at jsFilePath if loading fails
+ */
+static void csrfp_js_load(apr_pool_t *p, server_rec *s)
+{
+    csrfp_config *conf = ap_get_module_config(s->module_config,
+                                                &csrf_protector_module);
+    apr_file_t *f;
+    apr_finfo_t finfo;
+    apr_size_t n;
+    apr_status_t rv;
+    char *src, *js, *gz;
+
+    conf->jsUri = NULL;
+    conf->jsLink = NULL;
+    if (conf->jsFile == NULL)
+        return;
+
+    rv = apr_file_open(&f, conf->jsFile, APR_READ | APR_BINARY, APR_OS_DEFAULT, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f);
+        if (rv == APR_SUCCESS && (finfo.size <= 0 || finfo.size > CSRFP_JS_MAX_SIZE))
+            rv = APR_EINVAL;
+        if (rv == APR_SUCCESS) {
+            src = apr_palloc(p, finfo.size);
+            rv = apr_file_read_full(f, src, finfo.size, &n);
         }
+        apr_file_close(f);
     }
-    sqlite3_reset(res);
-    return result;
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "CSRFP unable to load csrfpJsFile %s, using jsFilePath", conf->jsFile);
+        return;
+    }
+
+    js = apr_palloc(p, n);
+    n = csrfp_js_minify(src, n, js);
+
+    // gzip it once, instead of mod_deflate on every request
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "CSRFP unable to compress csrfpJsFile %s, using jsFilePath", conf->jsFile);
+        return;
+    }
+    gz = apr_palloc(p, deflateBound(&zs, n));
+    zs.next_in = (Bytef *)js;
+    zs.avail_in = n;
+    zs.next_out = (Bytef *)gz;
+    zs.avail_out = deflateBound(&zs, n);
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "CSRFP unable to compress csrfpJsFile %s, using jsFilePath", conf->jsFile);
+        return;
+    }
+    conf->jsGz = gz;
+    conf->jsGzLen = zs.total_out;
+    deflateEnd(&zs);
+    conf->js = js;
+    conf->jsLen = n;
+
+    // Content changes, url changes, so it can be cached for good
+    unsigned char md[SHA_DIGEST_LENGTH];
+    char hex[CSRFP_JS_HASH_LENGTH * 2 + 1];
+    int i;
+
+    SHA1((const unsigned char *)js, n, md);
+    for (i = 0; i < CSRFP_JS_HASH_LENGTH; ++i) {
+        apr_snprintf(hex + i * 2, 3, "%02x", md[i]);
+    }
+    conf->jsUri = apr_pstrcat(p, CSRFP_JS_URI_PREFIX, hex, CSRFP_JS_URI_SUFFIX, NULL);
+    conf->jsLink = apr_psprintf(p, "<%s>; rel=preload; as=script", conf->jsUri);
 }
 
 /*
- * Function: csrfp_sql_addn
- * Function to add / Update token value in the db
+ * Function: csrfp_build_fragments
+ * Builds the <script> and <noscript> fragments injected into html
+ * responses of a server, they only depend on configuration
  *
- * Parameters: 
- * r - request_rec object
- * db - sqlite database object
- * sessid - session id for this user
- * value-  value of the token
+ * Parameters:
+ * p - configuration pool
+ * s - server_rec object
  *
- * Returns: 
- * integer, SQLITE_OK on success
+ * Returns:
+ * void
  */
-static int csrfp_sql_addn(request_rec *r, sqlite3 *db, const char *sessid, const char *value)
+static void csrfp_build_fragments(apr_pool_t *p, server_rec *s)
 {
-    // sessid of value cannot be null
-    if (sessid == NULL || value == NULL)
-        return -1;
+    csrfp_config *conf = ap_get_module_config(s->module_config,
+                                                &csrf_protector_module);
 
-    int timestamp = (unsigned)time(NULL);
-    
-    // Check if session id exists in db
-    int shouldUpdate = 0;
-    sqlite3_stmt *res;
-    const char *tail;
+    // <noscript> content to be injected
+    conf->noscript = apr_psprintf(p, "\n<noscript>\n%s\n</noscript>",
+                                conf->disablesJsMessage);
+    conf->noscriptLen = strlen(conf->noscript);
 
-    // #todo: you might want to create a seperate pool for this & destroy it later
-    const char *sql = apr_psprintf(r->pool, "SELECT sessid FROM CSRFP WHERE sessid = '%s'", sessid);
-    int rc = sqlite3_prepare_v2(db, sql, 1000, &res, &tail);
-    if (rc != SQLITE_OK) {
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-addn-select-error", tail);
-        #endif
-        return rc;
-    } else {
-        while (sqlite3_step(res) == SQLITE_ROW) {
-            ++shouldUpdate;
-            break;
-        }
+    // Parse the verifyGetFor rules of the server and generate the rule string to be appended to js
+    char *getRuleString = NULL;
+    int i;
+    for (i = 0; conf->allRules != NULL && i < conf->allRules->all->nelts; ++i) {
+        struct getRuleNode *rule = APR_ARRAY_IDX(conf->allRules->all, i, struct getRuleNode *);
+        if (getRuleString)
+            getRuleString = apr_pstrcat(p, getRuleString, ",'" , rule->patternString , "'", NULL);
+        else
+            getRuleString = apr_pstrcat(p, "'" , rule->patternString , "'", NULL);
     }
-    sqlite3_reset(res);
 
-    char *zErrMsg = NULL;
-    if (shouldUpdate == 0) {
-        // Insert
-        const char *sql_ = apr_psprintf(r->pool, "INSERT INTO CSRFP (sessid, token, timestamp) VALUES ('%s', '%s', %d)", sessid, value, timestamp);
-        rc = sqlite3_exec(db, sql_, 0, 0, &zErrMsg);
-        if (rc != SQLITE_OK) {
-            #ifdef DEBUG
-                apr_table_addn(r->headers_out, "sql-addn-insert-error", zErrMsg);
-            #endif
-            return rc;
-        }
-    } else {
-        // Update
-        const char *sql_ = apr_psprintf(r->pool, "UPDATE CSRFP SET token = '%s', timestamp = %d WHERE sessid = '%s'", value, timestamp, sessid);
-        rc = sqlite3_exec(db, sql_, 0, 0, &zErrMsg);
-        if (rc != SQLITE_OK) {
-            #ifdef DEBUG
-                apr_table_addn(r->headers_out, "sql-addn-update-error", zErrMsg);
-            #endif
-            return rc;
-        }
+    // <script> content to be injected
+    conf->script = apr_psprintf(p, "\n<script type=\"text/javascript\""
+                               " src=\"%s\"%s></script>\n"
+                               "<script type=\"text/JavaScript\">\n"
+                               "window.onload = function() {\n"
+                               "\t  CSRFP.checkForUrls = [%s];\n"
+                               "\t  CSRFP.CSRFP_TOKEN = '%s';\n"
+                               "%s"
+                               "\t  csrfprotector_init();\n"
+                               "}\n</script>\n",
+                                (conf->jsUri != NULL)? conf->jsUri: conf->jsFilePath,
+                                (conf->injectMode == inject_head)? " defer": "",
+                                (getRuleString == NULL)?"": getRuleString,
+                                conf->tokenName,
+                                (conf->tokenEndpoint == NULL)? "":
+                                    apr_psprintf(p, "\t  CSRFP.tokenEndpoint = '%s';\n",
+                                                conf->tokenEndpoint));
+    conf->scriptLen = strlen(conf->script);
+
+    // ETag suffix, changes whenever the injected fragments do
+    unsigned char md[APR_SHA1_DIGESTSIZE];
+    char hex[CSRFP_ETAG_HASH_LENGTH * 2 + 1];
+    apr_sha1_ctx_t sha;
+
+    apr_sha1_init(&sha);
+    apr_sha1_update(&sha, conf->noscript, conf->noscriptLen);
+    apr_sha1_update(&sha, conf->script, conf->scriptLen);
+    apr_sha1_final(md, &sha);
+    for (i = 0; i < CSRFP_ETAG_HASH_LENGTH; ++i) {
+        apr_snprintf(hex + i * 2, 3, "%02x", md[i]);
     }
-
-    return SQLITE_OK;
+    conf->etagSuffix = apr_pstrcat(p, CSRFP_ETAG_SUFFIX, hex, "\"", NULL);
 }
 
 /*
- * Funciton: csrfp_sql_match
- * Function to match value in db to value sent as param
+ * Function: csrfp_child_init
+ * Callback function for child init by Hook Registering function
  *
  * Parameters: 
- * r - request_rec object
- * db - sqlite database object
- * sessid - session id for this user
- * value - value to match
+ * p - child pool
+ * s - server_rec object
  *
- * Returns: 
- * 0 for correct match
+ * Returns:
+ * void
  */
-static int csrfp_sql_match(request_rec *r, sqlite3 *db, const char *sessid, const char *value)
+static void csrfp_child_init(apr_pool_t *p, server_rec *s)
 {
-    // sessid of value cannot be null
-    if (sessid == NULL || value == NULL)
-        return -1;
+    csrfp_sql_configure(p, s);
+    csrfp_shm_child_init(p, s);
+    csrfp_shm_vfs_register(s);
+}
 
-    int timestamp = (unsigned)time(NULL);
-    
-    // Check if session id exists in db
-    sqlite3_stmt *res;
-    const char *tail;
+/*
+ * Function: csrfp_pre_config
+ * Callback function for pre config, runs before the directives of
+ * every (re)read of the configuration
+ *
+ * Parameters:
+ * pconf - configuration pool
+ * plog - log pool
+ * ptemp - temporary pool
+ *
+ * Returns:
+ * status code, int
+ */
+static int csrfp_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    const char *ext, *exts = DEFAULT_IGNORE_EXTENSIONS;
 
-    // #todo: you might want to create a seperate pool for this & destroy it later
-    char *sql = apr_psprintf(r->pool, "SELECT timestamp FROM CSRFP WHERE sessid = '%s' AND token = '%s'", sessid, value);
-    int rc = sqlite3_prepare_v2(db, sql,1000, &res, &tail);
+    csrfp_rule_scopes = apr_array_make(pconf, 4, sizeof(csrfp_rule_scope));
 
-     if (rc != SQLITE_OK) {
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-match-select-error", tail);
-        #endif
-        return rc;
-    } else {
-        while (sqlite3_step(res) == SQLITE_ROW) {
-            if (timestamp > (atoi(sqlite3_column_text(res, 0)) + TOKEN_EXPIRY_MAXTIME)) {
-                ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-                        "CSRFP csrfp_sql_match return -1");
-                sqlite3_reset(res);
-                return -1;
-            }
-            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-                "CSRFP csrfp_sql_match return 0");
-            sqlite3_reset(res);
-            return 0;
-        }
-        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-              "CSRFP csrfp_sql_match return 1");
-        return 1;
-    }   
+    csrfp_ignore_default = apr_hash_make(pconf);
+    while (*(ext = ap_getword_white(pconf, &exts)) != '\0') {
+        apr_hash_set(csrfp_ignore_default, ext, APR_HASH_KEY_STRING, ext);
+    }
+    return OK;
 }
 
 /*
- * Function: csrfp_sql_table_clean
- * Function to clear expired tokens from db
+ * Function: csrfp_server_rules
+ * Function to gather the verifyGetFor rules of every scope of a server,
+ * its own and the main server's, which virtual hosts inherit
  *
- * Parameters: 
- * r - request_rec object
- * db - sqlite database object
+ * Parameters:
+ * p - configuration pool
+ * s - main server_rec object
+ * vs - server_rec object of the server
  *
- * Returns: 
- * void
+ * Returns:
+ * rules (struct getRuleNode *), each pattern once
  */
-
-static void csrfp_sql_table_clean(request_rec *r, sqlite3 *db)
+static apr_array_header_t *csrfp_server_rules(apr_pool_t *p, server_rec *s, server_rec *vs)
 {
-    int timestamp = (unsigned)time(NULL) - TOKEN_EXPIRY_MAXTIME;
-    char *sql = apr_psprintf(r->pool, "DELETE FROM CSRFP WHERE timestamp < '%d'", timestamp);
-    char *zErrMsg;
-    int rc = sqlite3_exec(db, sql, 0, 0, &zErrMsg);
-    if (rc != SQLITE_OK) {
-        #ifdef DEBUG
-            apr_table_addn(r->headers_out, "sql-clean-error", zErrMsg);
-        #endif
-        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-            "CSRFP cleaning %s.", zErrMsg);
+    apr_array_header_t *list = apr_array_make(p, 8, sizeof(struct getRuleNode *));
+    apr_hash_t *seen = apr_hash_make(p);
+    int i, j;
+
+    for (i = 0; i < csrfp_rule_scopes->nelts; ++i) {
+        csrfp_rule_scope *scope = &APR_ARRAY_IDX(csrfp_rule_scopes, i, csrfp_rule_scope);
+        if (scope->s != vs && scope->s != s)
+            continue;
+
+        for (j = 0; j < scope->rules->all->nelts; ++j) {
+            struct getRuleNode *rule = APR_ARRAY_IDX(scope->rules->all, j,
+                                                    struct getRuleNode *);
+            if (apr_hash_get(seen, rule->patternString, APR_HASH_KEY_STRING) == NULL) {
+                apr_hash_set(seen, rule->patternString, APR_HASH_KEY_STRING, rule);
+                APR_ARRAY_PUSH(list, struct getRuleNode *) = rule;
+            }
+        }
     }
+    return list;
 }
-//=====================================================================
-// Handlers -- call back functions for different hooks
-//=====================================================================
+
 /*
- * Function: csrfp_header_parser
- * Callback function for header parser by Hook Registering function
+ * Function: csrfp_post_config
+ * Callback function for post config by Hook Registering function
  *
- * Parameters:
- * r - request_rec object
+ * Parameters: 
+ * pconf - configuration pool
+ * plog - log pool
+ * ptemp - temporary pool
+ * s - server_rec object
  *
- * Return:
+ * Returns:
  * status code, int
  */
-static int csrfp_header_parser(request_rec *r)
+static int csrfp_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                apr_pool_t *ptemp, server_rec *s)
 {
-    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+    void *data = NULL;
+    server_rec *vs;
+    csrfp_config *mainConf = ap_get_module_config(s->module_config,
                                                 &csrf_protector_module);
-    if (conf->flag == CSRFP_FALSE) 
-        return OK;
-
-    if (!needvalidation(r)) {
-        // No need of validation, go ahead!
-        return OK;
-    }
+    apr_array_header_t *list;
+    int i;
 
-    // Start the sql connection
-    sqlite3 *db = csrfp_sql_init(r);
-    if (db == NULL) {
-        ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-                      "CSRFP UNABLE TO ACCESS DB OBJECT IN HEADER PARSER");
-        // #todo: ask Kevin/Abbas about this once
-        // Commented to avoid pages to be written
-        //ap_rprintf(r, "OWASP CSRF Protector - SQLITE3 Database Open Error");
-        return DONE;
+    // verifyGetFor rules of each scope are matched with a single regex where possible
+    for (i = 0; i < csrfp_rule_scopes->nelts; ++i) {
+        csrfp_rule_scope *scope = &APR_ARRAY_IDX(csrfp_rule_scopes, i, csrfp_rule_scope);
+        csrfp_rules_build(pconf, scope->s, scope->rules);
     }
 
-    // If request type is POST
-    // Need to check configs weather or not a validation is needed POST
-    if ( !strcmp(r->method, "POST")
-        && !validateToken(r, db)) {
-            
-        // Log this -- [x]
-        // Take actions as per configuration
-
-        return failedValidationAction(r);
-    } else if ( !strcmp(r->method, "GET") ) {
+    for (vs = s; vs != NULL; vs = vs->next) {
+        csrfp_config *conf = ap_get_module_config(vs->module_config,
+                                                &csrf_protector_module);
 
-        
+        // Virtual hosts without csrfp directives share the main server's
+        // record, they get their own for what is built here
+        if (vs != s && conf == mainConf) {
+            conf = apr_pmemdup(pconf, mainConf, sizeof(csrfp_config));
+            ap_set_module_config(vs->module_config, &csrf_protector_module, conf);
+        }
 
-        struct getRuleNode *p = getTop;
-        while (p != NULL) {
-            const char *currentUrl = apr_pstrcat(r->pool, "http://", getCurrentUrl(r), NULL);
-            const char *currentUrlSecure = apr_pstrcat(r->pool, "https://", getCurrentUrl(r), NULL);
-
-            if (ap_regexec(p->pattern, currentUrl, 0, NULL, 0) == 0
-                || ap_regexec(p->pattern, currentUrlSecure, 0, NULL, 0) == 0) {
-                if (!validateToken(r, db)) {
-
-                    // Means pattern matched && validation failed
-                    // Log this -- [x]
-                    // Take actions as per configuration
-                    // Close the sql connection
-                    sqlite3_close(db);
-                    return failedValidationAction(r);
-                }
-            }
-            p = p->next;
+        conf->allRules = NULL;
+        list = csrfp_server_rules(pconf, s, vs);
+        if (list->nelts > 0) {
+            conf->allRules = apr_pcalloc(pconf, sizeof(csrfp_rule_set));
+            conf->allRules->all = list;
+            csrfp_rules_build(pconf, vs, conf->allRules);
         }
+        csrfp_js_load(pconf, vs);
+        csrfp_build_fragments(pconf, vs);
     }
-    
-    // Close the sql connection
-    sqlite3_close(db);
 
-    // Information for output_filter to regenrate token and
-    // append it to output header -- Regenrate token
-    // Section to regenrate and send new Cookie Header (csrfp_token) to client
-    apr_table_add(r->subprocess_env, "regen_csrfptoken", CSRFP_REGEN_TOKEN);
+    csrfp_shm_create(pconf, s);
 
-    // Add environment variable for php to inform request has been
-    //      validated by mod_csrfp
-    apr_table_add(r->subprocess_env, "mod_csrfp_enabled", "true");
+    // Startup reads the config twice, snapshot only the pass which runs
+    apr_pool_userdata_get(&data, CSRFP_POST_CONFIG_KEY, s->process->pool);
+    if (data == NULL) {
+        apr_pool_userdata_set((const void *)1, CSRFP_POST_CONFIG_KEY,
+                              apr_pool_cleanup_null, s->process->pool);
+        return OK;
+    }
 
-    // Appends X-Protected-By header to output header
-    apr_table_addn(r->headers_out, "X-Protected-By", CSRFP_NAME_VERSION);
+    csrfp_shm_vfs_register(s);
+    csrfp_snapshot_init(pconf, ptemp, s);
     return OK;
 }
 
 /*
- * Function: csrfp_out_filter
- * Filters output generated by content generator and modify content
+ * Function: csrfp_etag_fixup
+ * Callback function for fixups, rewrites the derived ETags of injected
+ * pages in If-None-Match, so the handler can still answer 304 for them
  *
  * Parameters:
- * f - apache filter object
- * bb - apache brigade object
+ * r - request_rec object
  *
  * Returns:
- * apr_status_t code
+ * DECLINED, int
  */
-static apr_status_t csrfp_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+static int csrfp_etag_fixup(request_rec *r)
 {
-    request_rec *r = f->r;
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    const char *inm, *orig;
 
-    /**
-     * if request  file is image or js, ignore the filter on the top itself
-     */
-    if (!needvalidation(r)) {
-        // No need of validation, go ahead!
-        ap_remove_output_filter(f);
-        return ap_pass_brigade(f->next, bb);
+    if (!csrfp_enabled(r) || conf->etagSuffix == NULL || r->main != NULL)
+        return DECLINED;
+
+    // Request headers are shared with an internal redirect, mapped already
+    if (r->prev != NULL && apr_table_get(r->prev->notes, CSRFP_ETAG_NOTE)) {
+        apr_table_setn(r->notes, CSRFP_ETAG_NOTE, "1");
+        return DECLINED;
     }
 
-    // Get the context config
-    csrfp_opf_ctx *rctx = csrfp_get_rctx(r);
+    inm = apr_table_get(r->headers_in, "If-None-Match");
+    if (inm == NULL)
+        return DECLINED;
 
-    /*
-     * - Determine if it's html and force chunked response
-     * - search <body to insert <noscript> .. </noscript> info
-     * - search </body> to insert script
-     * - set csrfp_token cookie
-     * - end (all done)
-     */
-    if(rctx->state == op_init) {
-        const char *type = getOutputContentType(r);
-        if(type == NULL || ( strncasecmp(type, "text/html", 9) != 0
-            && strncasecmp(type, "text/xhtml", 10) != 0) ) {
-            // we don't want to parse this response (no html)
-            rctx->state = op_end;
-            rctx->search = NULL;
-            ap_remove_output_filter(f);
-        } else {
-            // start searching head/body to inject our script
+    orig = csrfp_etag_original(r->pool, inm, conf->etagSuffix);
+    if (orig != NULL) {
+        apr_table_set(r->headers_in, "If-None-Match", orig);
+        apr_table_setn(r->notes, CSRFP_ETAG_NOTE, "1");
+    }
+    return DECLINED;
+}
 
-            // -- need to modify the Content-Length header
-            if(CSRFP_CHUNKED_ONLY) {
-                // send as chunked response
-                apr_table_unset(r->headers_out, "Content-Length");
-                apr_table_unset(r->err_headers_out, "Content-Length");
-                r->chunked = 1;
-                rctx->clstate = modified;  // Content-Length need not be modified anymore
-            } else {
-                // Modify the content-length header -- if available
-                /**
-                 * #todo: probably Content-Length is not generated by the time this hook is called
-                 *          So we might want this be done by later hook
-                 *          Calculate the content-length value?
-                 */
-                int errh = 0;
-                const char* cl =  apr_table_get(r->headers_out, "Content-Length");
-                if(!cl) {
-                    errh = 1;
-                    cl =  apr_table_get(r->err_headers_out, "Content-Length");
-                }
+/*
+ * Function: csrfp_insert_error_filter
+ * Callback function for insert error filter. A handler answering 304
+ * itself (ap_meets_conditions) goes through ap_die, which drops
+ * csrfp_out_filter before the headers go out, the ETag of the injected
+ * page is put back here
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_insert_error_filter(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
 
-                if(cl) {
-                    // adjust non-chunked response
-                    char *length;
-                    apr_off_t s;
-                    char *errp = NULL;
-                    if(apr_strtoff(&s, cl, &errp, 10) == APR_SUCCESS) {
-                        s = s + strlen(rctx->script) + strlen(rctx->noscript);
-                        length = apr_psprintf(r->pool, "%"APR_OFF_T_FMT, s);
-                        if(!errh) {
-                            apr_table_set(r->headers_out, "Content-Length", length);
-                        } else {
-                            apr_table_set(r->err_headers_out, "Content-Length", length);
-                        }
-                    } else {
-                        // fallback to chunked
-                        r->chunked = 1;
-                        if(!errh) {
-                            apr_table_unset(r->headers_out, "Content-Length");
-                        } else {
-                            apr_table_unset(r->err_headers_out, "Content-Length");
-                        }
-                    }
+    if (r->status != HTTP_NOT_MODIFIED || r->main != NULL || conf->etagSuffix == NULL
+        || !apr_table_get(r->notes, CSRFP_ETAG_NOTE))
+        return;
 
-                    rctx->clstate = modified;  // Content-Length need not be modified anymore
-                } else {
-                    // This means Content-Length header has not yet been generated
-                    // #todo need to do something about this
-                }
-            }
-        }
+    csrfp_etag_derive(r, conf);
+}
+
+/*
+ * Variable: csrfp_static_types
+ * Content-Type prefixes of static files that never carry html
+ */
+static const char *csrfp_static_types[] = {
+    "image/", "audio/", "video/", "font/",
+    "text/css", "text/javascript", "application/javascript",
+    "application/x-javascript", "application/json", "application/pdf",
+    NULL
+};
+
+/*
+ * Function: csrfp_js_handler
+ * Callback function for handler, serves csrfpJsFile from memory at its
+ * versioned url, gzip encoded if the client accepts it
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:
+ * status code, int
+ */
+static int csrfp_js_handler(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    const char *body = conf->js, *ae;
+    apr_size_t len = conf->jsLen;
+    apr_bucket_brigade *bb;
+
+    if (conf->jsUri == NULL || strcmp(r->uri, conf->jsUri))
+        return DECLINED;
+
+    if (r->method_number != M_GET)
+        return HTTP_METHOD_NOT_ALLOWED;
+
+    ae = apr_table_get(r->headers_in, "Accept-Encoding");
+    if (ae != NULL && ap_find_token(r->pool, ae, "gzip")) {
+        apr_table_setn(r->headers_out, "Content-Encoding", "gzip");
+        body = conf->jsGz;
+        len = conf->jsGzLen;
     }
 
-    // start searching within this brigade...
-    if (rctx->search) {
-        apr_bucket *b;
-
-        // Create custo pool for Output Filter
-        apr_pool_t *pool;
-        apr_pool_create(&pool, r->pool);
-
-        for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b)) {
-            if (APR_BUCKET_IS_EOS(b)) {
-                /* If we ever see an EOS, make sure to FLUSH. */
-                apr_bucket *flush = apr_bucket_flush_create(f->c->bucket_alloc);
-                APR_BUCKET_INSERT_BEFORE(b, flush);
-            }
+    // The url changes with the content, so it never needs revalidation
+    apr_table_setn(r->headers_out, "Cache-Control", "public, max-age=31536000, immutable");
+    apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+    ap_set_content_type(r, "application/javascript");
+    ap_set_content_length(r, len);
+    if (r->header_only)
+        return OK;
 
-            if (!(APR_BUCKET_IS_METADATA(b))) {
-                const char *buf;
-                apr_size_t nbytes;
-                int findBracketOnly = 0;
-                /**
-                 * Concept: While searching for a string say '<body(.*)>' in a buffer
-                 * 4 cases are possible in a bucket
-                 *  1. '<body' found & '>' found
-                 *  2. '<body' found & '>' not found i.e. '>' in next bucket
-                 *  3. '<body' not found, but cause of bucket overlap, for ex
-                 *      ... '<bo' in one bucket, 'dy(.*)>' in another
-                 *  4. '<body' not found, no overlap issue
-                 */
-                restart:
-                if (apr_bucket_read(b, &buf, &nbytes, APR_BLOCK_READ) == APR_SUCCESS) {
-                    if (nbytes > 0) {
-                        // Create a new string = overlap_buf + buf
-                        const char *nbuf = apr_pstrcat(pool, rctx->overlap_buf,
-                                                buf, NULL);
-                        const char *marker = NULL;
-                        apr_size_t sz;
-                        marker = csrfp_strncasestr(nbuf, rctx->search, nbytes);
-                        //apr_table_addn(r->headers_out, "xyz", marker);
-                        if (marker || findBracketOnly) {
-                            // ..search was found
-                            if (rctx->state == op_init
-                                || findBracketOnly) {
-
-                                // Seach for '<body' now searching for first '>'
-                                // Or checking if it does not exist in current bucket
-                                apr_size_t buflen = strlen(buf);
-
-                                // Setting for case - 2, '<body' found in prev bucket
-                                apr_size_t markerlen = 0;
-                                apr_size_t sz = 0;
-                                const char *c = buf;
-
-                                if (!findBracketOnly) {
-                                    // setting for case - 1 '<body' in same bucket
-                                    markerlen = strlen(marker);
-                                    sz = buflen - markerlen;
-                                    c = marker;
-                                }
-
-                                int offset = 0, flag = 0;
-                                for ( ; *c != '>'; offset++, c++) {
-                                    if ((offset + markerlen) == buflen) {
-                                        ++flag;
-                                        break;
-                                    }
-                                }
-
-                                if (!flag) {
-                                    // case - 1, <body and > in same bucket
-                                    sz += ++offset;
-                                    b = csrfp_inject(r, bb, b, rctx, buf, sz, 0);
-                                    findBracketOnly = 0;
-                                } else {
-                                    // case - 2, <body found, need to find > in next buffer
-                                    b = APR_BUCKET_NEXT(b);
-                                    ++findBracketOnly;
-                                }
-                                
-                                goto restart;
-                            } else if (rctx->state == op_body_init) {
-                                apr_size_t sz = strlen(buf) - strlen(marker) + sizeof("</body>") - 1;
-                                b = csrfp_inject(r, bb, b, rctx, buf, sz, 1);
-                            }
-                        } else {
-                            // case - 3 or 4 '<body' not found in current bucket
-                            const char *cptr = buf + (sizeof buf) - CSRFP_OVERLAP_BUCKET_SIZE;
-                            apr_cpystrn(rctx->overlap_buf, cptr, CSRFP_OVERLAP_BUCKET_SIZE);
-                        }
-                    }
-                }
-            }
-        }
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(body, len,
+                                r->connection->bucket_alloc));
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(r->connection->bucket_alloc));
+    return ap_pass_brigade(r->output_filters, bb);
+}
 
-        apr_pool_destroy(pool);
-    }
-    
-    const char *regenToken = apr_table_get(r->subprocess_env, "regen_csrfptoken");
-    if (regenToken && !strcasecmp(regenToken, CSRFP_REGEN_TOKEN)) {
-        /*
-         * - Regenrate token
-         * - Send it as output header
-         */
+/*
+ * Function: csrfp_token_handler
+ * Callback function for handler, answers requests to csrfpTokenEndpoint
+ * with the token cookies and an empty, never cached body
+ *
+ * Parameters:
+ * r - request_rec object
+ *
+ * Returns:
+ * status code, int
+ */
+static int csrfp_token_handler(request_rec *r)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
 
-        // Start the sql connection
-        sqlite3 *db = csrfp_sql_init(r);
-        if (db == NULL) {
-            ap_log_rerror(APLOG_MARK, APLOG_NOERRNO|APLOG_ERR, 0, r,
-                      "CSRFP UNABLE TO ACCESS DB OBJECT IN FILTER FUNCTION");
-        } else {
-            setTokenCookie(r, db);
-        }
+    if (!csrfp_enabled(r) || conf->tokenEndpoint == NULL
+        || strcmp(r->uri, conf->tokenEndpoint))
+        return DECLINED;
 
-        // Clean old expired values
-        csrfp_sql_table_clean(r, db);
+    if (r->method_number != M_GET)
+        return HTTP_METHOD_NOT_ALLOWED;
 
-        // Close the sql connection
-        sqlite3_close(db);
-    }
-    return ap_pass_brigade(f->next, bb);
+    if (csrfp_issue_token(r) == NULL)
+        return HTTP_SERVICE_UNAVAILABLE;
+
+    apr_table_setn(r->headers_out, "Cache-Control", "no-store, no-cache, must-revalidate");
+    apr_table_setn(r->headers_out, "Pragma", "no-cache");
+    apr_table_setn(r->headers_out, "Expires", "0");
+    ap_set_content_type(r, "text/plain");
+    ap_set_content_length(r, 0);
+    return OK;
+}
+
+/*
+ * Function: csrfp_quick_handler
+ * Callback function for quick handler, runs before mod_cache's and
+ * adds csrfp_token_filter, so responses served from the cache get
+ * the token cookies too
+ *
+ * Parameters:
+ * r - request_rec object
+ * lookup - non zero if only looking up a subrequest
+ *
+ * Returns:
+ * DECLINED, int
+ */
+static int csrfp_quick_handler(request_rec *r, int lookup)
+{
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+
+    if (lookup || r->main != NULL || !csrfp_enabled(r)
+        || conf->tokenEndpoint != NULL)
+        return DECLINED;
+
+    ap_add_output_filter("csrfp_token_filter", NULL, r, r->connection);
+    apr_table_setn(r->notes, CSRFP_TOKEN_FILTER_NOTE, "1");
+    return DECLINED;
 }
 
 /*
  * Function: csrfp_insert_filter
- * Registers in filter -- csrfp_in_filter
+ * Registers out filter -- csrfp_out_filter, only for requests whose
+ * response can be html the script gets injected in
  *
- * Parameters: 
+ * Parameters:
  * r - request_rec object
  *
  * Returns:
@@ -1348,6 +4992,42 @@ static apr_status_t csrfp_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
  */
 static void csrfp_insert_filter(request_rec *r)
 {
+    csrfp_config *conf = ap_get_module_config(r->server->module_config,
+                                                &csrf_protector_module);
+    int i;
+
+    // Output of subrequests runs into the filters of the main request,
+    // which issue the token and inject once for the whole page
+    if (!csrfp_enabled(r) || r->main != NULL)
+        return;
+
+    // Token cookies, unless csrfp_quick_handler added the filter already
+    // or csrfp_token_handler sets them
+    if (conf->tokenEndpoint == NULL && !apr_table_get(r->notes, CSRFP_TOKEN_FILTER_NOTE)) {
+        ap_add_output_filter("csrfp_token_filter", NULL, r, r->connection);
+    }
+
+    // No body to inject into
+    if (r->header_only
+        || r->method_number == M_OPTIONS) {
+        return;
+    }
+
+    if (!needvalidation(r)) {
+        return;
+    }
+
+    // A static file (no handler but the default one) of a known non html type
+    if (r->content_type
+        && (r->handler == NULL || !strcmp(r->handler, "default-handler"))) {
+        for (i = 0; csrfp_static_types[i] != NULL; ++i) {
+            if (!strncasecmp(r->content_type, csrfp_static_types[i],
+                            strlen(csrfp_static_types[i]))) {
+                return;
+            }
+        }
+    }
+
     ap_add_output_filter("csrfp_out_filter", NULL, r, r->connection);
 }
 
@@ -1360,9 +5040,25 @@ static void csrfp_insert_filter(request_rec *r)
  */
 static void *csrfp_srv_config_create(apr_pool_t *p, server_rec *s)
 {
+    csrfp_config *config = apr_pcalloc(p, sizeof(csrfp_config));
+
+    if (s->is_virtual) {
+        // Left unset, csrfp_srv_config_merge takes them from the main server
+        config->action = action_unset;
+        config->tokenLength = CSRFP_UNSET;
+        config->errorRedirectionUri = csrfp_unset;
+        config->errorCustomMessage = csrfp_unset;
+        config->storeTimeout = CSRFP_UNSET;
+        config->storeFailAction = store_action_unset;
+        config->injectMode = inject_unset;
+        config->scanLimit = CSRFP_UNSET;
+        config->tokenEndpoint = csrfp_unset;
+        config->jsFile = csrfp_unset;
+        config->rewriteForms = CSRFP_FLAG_UNSET;
+        return config;
+    }
+
     // Registering default configurations
-    config = apr_pcalloc(p, sizeof(csrfp_config));
-    config->flag = CSRFP_TRUE;
     config->action = forbidden;
     config->tokenLength = DEFAULT_TOKEN_LENGTH;
 
@@ -1391,30 +5087,163 @@ static void *csrfp_srv_config_create(apr_pool_t *p, server_rec *s)
     apr_cpystrn(config->disablesJsMessage, DEFAULT_DISABLED_JS_MESSSAGE,
             CSRFP_DISABLED_JS_MESSAGE_MAXLENGTH);
 
-    // Allocate memory and set regex for ignore-pattern regex object
-    config->ignore_pattern = ap_pregcomp(p, CSRFP_IGNORE_PATTERN, AP_REG_ICASE);
+    // Token store time budget and circuit breaker
+    config->storeTimeout = DEFAULT_STORE_TIMEOUT;
+    config->storeFailThreshold = DEFAULT_STORE_FAIL_THRESHOLD;
+    config->storeRetryAfter = DEFAULT_STORE_RETRY_AFTER;
+    config->storeFailAction = store_reject;
+    config->storeBackend = store_file;
+    config->storeShmSize = DEFAULT_STORE_SHM_SIZE * 1024;
+    config->snapshotFile = NULL;
+    config->injectMode = inject_body;
+    config->scanLimit = DEFAULT_SCAN_LIMIT;
+    config->tokenEndpoint = NULL;
+    config->jsFile = NULL;
+    config->rewriteForms = CSRFP_FALSE;
 
     return config;
 }
 
+/**
+ * Handler to merge the config of a virtual host with the main server's
+ * Store settings are process wide, they always come from the main server
+ *
+ * @param: standard parameters, @return merged config
+ */
+static void *csrfp_srv_config_merge(apr_pool_t *p, void *basev, void *addv)
+{
+    csrfp_config *base = basev, *add = addv;
+    csrfp_config *conf = apr_pcalloc(p, sizeof(csrfp_config));
+
+#define CSRFP_MERGE(field, unset) \
+    conf->field = (add->field == (unset)) ? base->field : add->field
+
+    CSRFP_MERGE(action, action_unset);
+    CSRFP_MERGE(errorRedirectionUri, csrfp_unset);
+    CSRFP_MERGE(errorCustomMessage, csrfp_unset);
+    CSRFP_MERGE(jsFilePath, NULL);
+    CSRFP_MERGE(tokenLength, CSRFP_UNSET);
+    CSRFP_MERGE(tokenName, NULL);
+    CSRFP_MERGE(disablesJsMessage, NULL);
+    CSRFP_MERGE(storeTimeout, CSRFP_UNSET);
+    CSRFP_MERGE(storeFailAction, store_action_unset);
+    CSRFP_MERGE(injectMode, inject_unset);
+    CSRFP_MERGE(scanLimit, CSRFP_UNSET);
+    CSRFP_MERGE(tokenEndpoint, csrfp_unset);
+    CSRFP_MERGE(jsFile, csrfp_unset);
+    CSRFP_MERGE(rewriteForms, CSRFP_FLAG_UNSET);
+
+#undef CSRFP_MERGE
+
+    // Sections of the main server apply to virtual hosts too
+    conf->scoped = base->scoped || add->scoped;
+
+    conf->storeFailThreshold = base->storeFailThreshold;
+    conf->storeRetryAfter = base->storeRetryAfter;
+    conf->storeBackend = base->storeBackend;
+    conf->storeShmSize = base->storeShmSize;
+    conf->snapshotFile = base->snapshotFile;
+
+    return conf;
+}
+
+/**
+ * Handler to allocate the per directory config, everything unset
+ *
+ * @param: standard parameters, @return void
+ */
+static void *csrfp_dir_config_create(apr_pool_t *p, char *dir)
+{
+    csrfp_dir_config *dconf = apr_pcalloc(p, sizeof(csrfp_dir_config));
+    dconf->flag = CSRFP_FLAG_UNSET;
+    return dconf;
+}
+
+/**
+ * Handler to merge per directory configs, the inner scope wins.
+ * Ignored prefixes add up, so do ignored extensions unless the inner
+ * scope gave 'none', verifyGetFor rules of a scope replace the
+ * outer ones as they are compiled per scope at post config
+ *
+ * @param: standard parameters, @return merged config
+ */
+static void *csrfp_dir_config_merge(apr_pool_t *p, void *basev, void *addv)
+{
+    csrfp_dir_config *base = basev, *add = addv;
+    csrfp_dir_config *dconf = apr_pcalloc(p, sizeof(csrfp_dir_config));
+
+    dconf->flag = (add->flag == CSRFP_FLAG_UNSET) ? base->flag : add->flag;
+
+    if (add->ignoreNone) {
+        dconf->ignoreNone = 1;
+        dconf->ignoreAdd = add->ignoreAdd;
+        dconf->ignoreExt = add->ignoreExt;
+    } else if (add->ignoreAdd != NULL) {
+        // Extensions of this scope on top of the outer ones
+        dconf->ignoreNone = base->ignoreNone;
+        dconf->ignoreAdd = (base->ignoreAdd != NULL)
+            ? apr_hash_overlay(p, add->ignoreAdd, base->ignoreAdd) : add->ignoreAdd;
+        dconf->ignoreExt = apr_hash_overlay(p, add->ignoreAdd,
+            (base->ignoreExt != NULL) ? base->ignoreExt : csrfp_ignore_default);
+    } else {
+        dconf->ignoreNone = base->ignoreNone;
+        dconf->ignoreAdd = base->ignoreAdd;
+        dconf->ignoreExt = base->ignoreExt;
+    }
+
+    if (base->ignorePrefix != NULL && add->ignorePrefix != NULL) {
+        dconf->ignorePrefix = apr_array_append(p, base->ignorePrefix, add->ignorePrefix);
+    } else {
+        dconf->ignorePrefix = (add->ignorePrefix != NULL) ? add->ignorePrefix : base->ignorePrefix;
+    }
+    dconf->rules = (add->rules != NULL) ? add->rules : base->rules;
+
+    return dconf;
+}
+
 //=============================================================
 // Configuration handler functions 
 //=============================================================
 
+/*
+ * Function: csrfp_scoped_cmd
+ * Notes a directive set in a <Directory> or <Location> of the server,
+ * cache hits are answered before those sections are merged
+ *
+ * Parameters:
+ * cmd - cmd_parms of the directive
+ *
+ * Returns:
+ * void
+ */
+static void csrfp_scoped_cmd(cmd_parms *cmd)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    if (cmd->path != NULL)
+        config->scoped = 1;
+}
+
 /** csrfEnable **/
 const char *csrfp_enable_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
-    if(!strcasecmp(arg, "off")) config->flag = CSRFP_FALSE;
-    else config->flag = CSRFP_TRUE;
+    csrfp_dir_config *dconf = cfg;
+
+    csrfp_scoped_cmd(cmd);
+
+    if(!strcasecmp(arg, "off")) dconf->flag = CSRFP_FALSE;
+    else dconf->flag = CSRFP_TRUE;
     return NULL;
 }
 
 /** tokenName **/
 const char *csrfp_tokenName_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->tokenName, arg,
-        CSRFP_TOKEN_NAME_MAXLENGTH);
+        config->tokenName = apr_pstrndup(cmd->pool, arg,
+        CSRFP_TOKEN_NAME_MAXLENGTH - 1);
     }
     // Else default value will be set
 
@@ -1424,6 +5253,8 @@ const char *csrfp_tokenName_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 /** csrfAction **/
 const char *csrfp_action_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
     if(!strcasecmp(arg, "forbidden"))
         config->action = forbidden;
     else if (!strcasecmp(arg, "strip"))
@@ -1442,9 +5273,11 @@ const char *csrfp_action_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 /** errorRedirectionUri **/
 const char *csrfp_errorRedirectionUri_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->errorRedirectionUri, arg,
-        CSRFP_URI_MAXLENGTH);
+        config->errorRedirectionUri = apr_pstrndup(cmd->pool, arg,
+        CSRFP_URI_MAXLENGTH - 1);
     }
     else config->errorRedirectionUri = NULL;
 
@@ -1454,9 +5287,11 @@ const char *csrfp_errorRedirectionUri_cmd(cmd_parms *cmd, void *cfg, const char
 /** errorCustomMessage **/
 const char *csrfp_errorCustomMessage_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->errorCustomMessage, arg,
-        CSRFP_ERROR_MESSAGE_MAXLENGTH);
+        config->errorCustomMessage = apr_pstrndup(cmd->pool, arg,
+        CSRFP_ERROR_MESSAGE_MAXLENGTH - 1);
     }
     else config->errorCustomMessage = NULL;
 
@@ -1466,9 +5301,11 @@ const char *csrfp_errorCustomMessage_cmd(cmd_parms *cmd, void *cfg, const char *
 /** jsFilePath **/
 const char *csrfp_jsFilePath_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->jsFilePath, arg,
-            CSRFP_URI_MAXLENGTH);
+        config->jsFilePath = apr_pstrndup(cmd->pool, arg,
+            CSRFP_URI_MAXLENGTH - 1);
     }
     //no else as default config shall come to effect
 
@@ -1478,6 +5315,8 @@ const char *csrfp_jsFilePath_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 /** tokenLength **/
 const char *csrfp_tokenLength_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
     if(strlen(arg) > 0) {
         int length = atoi(arg);
         if (length < DEFAULT_TOKEN_MINIMUM_LENGTH
@@ -1493,9 +5332,11 @@ const char *csrfp_tokenLength_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 /** disablesJsMessage **/
 const char *csrfp_disablesJsMessage_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
     if(strlen(arg) > 0) {
-        apr_cpystrn(config->disablesJsMessage, arg,
-            CSRFP_DISABLED_JS_MESSAGE_MAXLENGTH);
+        config->disablesJsMessage = apr_pstrndup(cmd->pool, arg,
+            CSRFP_DISABLED_JS_MESSAGE_MAXLENGTH - 1);
     }
     //no else as default config shall come to effect
 
@@ -1505,26 +5346,279 @@ const char *csrfp_disablesJsMessage_cmd(cmd_parms *cmd, void *cfg, const char *a
 /** verifyGetFor **/
 const char *csrfp_verifyGetFor_cmd(cmd_parms *cmd, void *cfg, const char *arg)
 {
+    csrfp_dir_config *dconf = cfg;
+
     if(strlen(arg) > 0) {
         // Create a Node
         struct getRuleNode *p;
         p = apr_pcalloc(cmd->pool, sizeof (struct getRuleNode));
-        p->next = NULL;
 
         p->patternString = apr_pstrdup(cmd->pool, arg);
-        p->pattern = apr_pcalloc(cmd->pool, sizeof (p->pattern));
-        ap_regcomp(p->pattern, arg, 0);
-
-        // Add to linked list
-        if (getTop == NULL) {
-            // First element
-            getTop = p;
-            getPointer = p;
-        } else {
-            getPointer->next = p;
-            getPointer = p;
+        p->pattern = ap_pregcomp(cmd->pool, arg, 0);
+        if (p->pattern == NULL)
+            return apr_pstrcat(cmd->pool, "Invalid verifyGetFor pattern ", arg, NULL);
+
+        // First rule of the scope, the set gets compiled at post config.
+        // Merged configs of virtual hosts already point to it by then
+        if (dconf->rules == NULL) {
+            csrfp_rule_scope *scope = apr_array_push(csrfp_rule_scopes);
+            dconf->rules = apr_pcalloc(cmd->pool, sizeof(csrfp_rule_set));
+            dconf->rules->all = apr_array_make(cmd->pool, 4, sizeof(struct getRuleNode *));
+            scope->s = cmd->server;
+            scope->rules = dconf->rules;
         }
+        APR_ARRAY_PUSH(dconf->rules->all, struct getRuleNode *) = p;
+    }
+
+    return NULL;
+}
+
+/** csrfpStoreTimeout **/
+const char *csrfp_storeTimeout_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    int timeout = atoi(arg);
+    if (timeout < 0)
+        return "csrfpStoreTimeout must be a positive number of milliseconds or 0";
+    config->storeTimeout = timeout;
+
+    return NULL;
+}
+
+/** csrfpStoreFailThreshold **/
+const char *csrfp_storeFailThreshold_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL)
+        return err;
+
+    int threshold = atoi(arg);
+    if (threshold < 0)
+        return "csrfpStoreFailThreshold must be a positive number or 0";
+    config->storeFailThreshold = threshold;
+
+    return NULL;
+}
+
+/** csrfpStoreRetryAfter **/
+const char *csrfp_storeRetryAfter_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL)
+        return err;
+
+    int seconds = atoi(arg);
+    if (seconds <= 0)
+        return "csrfpStoreRetryAfter must be a positive number of seconds";
+    config->storeRetryAfter = seconds;
+
+    return NULL;
+}
+
+/** csrfpStoreFailAction **/
+const char *csrfp_storeFailAction_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    if (!strcasecmp(arg, "reject"))
+        config->storeFailAction = store_reject;
+    else if (!strcasecmp(arg, "accept"))
+        config->storeFailAction = store_accept;
+    else if (!strcasecmp(arg, "stateless"))
+        config->storeFailAction = store_stateless;
+    else
+        return "csrfpStoreFailAction must be one of 'reject', 'accept' or 'stateless'";
+
+    return NULL;
+}
+
+/** csrfpStoreBackend **/
+const char *csrfp_storeBackend_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL)
+        return err;
+
+    if (!strcasecmp(arg, "file"))
+        config->storeBackend = store_file;
+    else if (!strcasecmp(arg, "shm"))
+        config->storeBackend = store_shm;
+    else
+        return "csrfpStoreBackend must be one of 'file' or 'shm'";
+
+    return NULL;
+}
+
+/** csrfpStoreShmSize **/
+const char *csrfp_storeShmSize_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL)
+        return err;
+
+    int size = atoi(arg);
+    if (size < 64 || size > 1024 * 1024)
+        return "csrfpStoreShmSize must be between 64 and 1048576 KB";
+    config->storeShmSize = (apr_size_t)size * 1024;
+
+    return NULL;
+}
+
+/** csrfpSnapshotFile **/
+const char *csrfp_snapshotFile_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL)
+        return err;
+
+    if (!strcasecmp(arg, "none")) {
+        config->snapshotFile = NULL;
+        return NULL;
+    }
+
+    config->snapshotFile = ap_server_root_relative(cmd->pool, arg);
+    if (config->snapshotFile == NULL)
+        return apr_pstrcat(cmd->pool, "Invalid csrfpSnapshotFile path ", arg, NULL);
+
+    return NULL;
+}
+
+/** csrfpInjectMode **/
+const char *csrfp_injectMode_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    if (!strcasecmp(arg, "body"))
+        config->injectMode = inject_body;
+    else if (!strcasecmp(arg, "head"))
+        config->injectMode = inject_head;
+    else
+        return "csrfpInjectMode must be one of 'body' or 'head'";
+
+    return NULL;
+}
+
+/** csrfpScanLimit **/
+const char *csrfp_scanLimit_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    apr_off_t limit;
+    char *end = NULL;
+    if (apr_strtoff(&limit, arg, &end, 10) != APR_SUCCESS || *end != '\0'
+        || limit < 0)
+        return "csrfpScanLimit must be a number of bytes, 0 for no limit";
+    config->scanLimit = limit;
+
+    return NULL;
+}
+
+/** csrfpTokenEndpoint **/
+const char *csrfp_tokenEndpoint_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    if (!strcasecmp(arg, "none")) {
+        config->tokenEndpoint = NULL;
+        return NULL;
+    }
+
+    if (arg[0] != '/' || strchr(arg, '\''))
+        return "csrfpTokenEndpoint must be a path starting with '/', or none";
+    config->tokenEndpoint = apr_pstrdup(cmd->pool, arg);
+
+    return NULL;
+}
+
+/** csrfpJsFile **/
+const char *csrfp_jsFile_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    if (!strcasecmp(arg, "none")) {
+        config->jsFile = NULL;
+        return NULL;
+    }
+
+    config->jsFile = ap_server_root_relative(cmd->pool, arg);
+    if (config->jsFile == NULL)
+        return apr_pstrcat(cmd->pool, "Invalid csrfpJsFile path ", arg, NULL);
+
+    return NULL;
+}
+
+/** csrfpRewriteForms **/
+const char *csrfp_rewriteForms_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_config *config = ap_get_module_config(cmd->server->module_config,
+                                                &csrf_protector_module);
+    if(!strcasecmp(arg, "on")) config->rewriteForms = CSRFP_TRUE;
+    else config->rewriteForms = CSRFP_FALSE;
+    return NULL;
+}
+
+/** csrfpIgnoreExtensions **/
+const char *csrfp_ignoreExtensions_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_dir_config *dconf = cfg;
+    char *ext;
+
+    csrfp_scoped_cmd(cmd);
+
+    // 'none' drops the extensions given so far, the outer and the default ones
+    if (!strcasecmp(arg, "none")) {
+        dconf->ignoreNone = 1;
+        dconf->ignoreAdd = NULL;
+        dconf->ignoreExt = apr_hash_make(cmd->pool);
+        return NULL;
+    }
+
+    // ignoreExt holds the set as if this were the outermost scope,
+    // csrfp_dir_config_merge puts ignoreAdd on top of the outer set
+    if (dconf->ignoreAdd == NULL) {
+        dconf->ignoreAdd = apr_hash_make(cmd->pool);
+    }
+    if (dconf->ignoreExt == NULL) {
+        dconf->ignoreExt = apr_hash_copy(cmd->pool, csrfp_ignore_default);
+    }
+
+    if (*arg == '.')
+        ++arg;
+    if (*arg == '\0' || strlen(arg) >= CSRFP_EXTENSION_MAXLENGTH || strchr(arg, '/'))
+        return apr_pstrcat(cmd->pool, "Invalid csrfpIgnoreExtensions extension ", arg, NULL);
+
+    ext = apr_pstrdup(cmd->pool, arg);
+    ap_str_tolower(ext);
+    apr_hash_set(dconf->ignoreAdd, ext, APR_HASH_KEY_STRING, ext);
+    apr_hash_set(dconf->ignoreExt, ext, APR_HASH_KEY_STRING, ext);
+
+    return NULL;
+}
+
+/** csrfpIgnorePrefix **/
+const char *csrfp_ignorePrefix_cmd(cmd_parms *cmd, void *cfg, const char *arg)
+{
+    csrfp_dir_config *dconf = cfg;
+
+    csrfp_scoped_cmd(cmd);
+    if (arg[0] != '/')
+        return "csrfpIgnorePrefix paths must start with '/'";
+
+    if (dconf->ignorePrefix == NULL) {
+        dconf->ignorePrefix = apr_array_make(cmd->pool, 2, sizeof(const char *));
     }
+    APR_ARRAY_PUSH(dconf->ignorePrefix, const char *) = apr_pstrdup(cmd->pool, arg);
 
     return NULL;
 }
@@ -1559,6 +5653,48 @@ static const command_rec csrfp_directives[] =
     AP_INIT_ITERATE("verifyGetFor", csrfp_verifyGetFor_cmd, NULL,
                 RSRC_CONF|ACCESS_CONF,
                 "Pattern of urls for which GET request CSRF validation is enabled"),
+    AP_INIT_TAKE1("csrfpStoreTimeout", csrfp_storeTimeout_cmd, NULL,
+                RSRC_CONF,
+                "Time budget in ms for token store operations per request, 0 for no limit"),
+    AP_INIT_TAKE1("csrfpStoreFailThreshold", csrfp_storeFailThreshold_cmd, NULL,
+                RSRC_CONF,
+                "Consecutive token store failures after which the store is suspended"),
+    AP_INIT_TAKE1("csrfpStoreRetryAfter", csrfp_storeRetryAfter_cmd, NULL,
+                RSRC_CONF,
+                "Seconds a suspended token store is left alone before retrying"),
+    AP_INIT_TAKE1("csrfpStoreFailAction", csrfp_storeFailAction_cmd, NULL,
+                RSRC_CONF,
+                "Action when token store is unavailable 'reject'|'accept'|'stateless'"),
+    AP_INIT_TAKE1("csrfpStoreBackend", csrfp_storeBackend_cmd, NULL,
+                RSRC_CONF,
+                "Where token database is kept 'file'|'shm', default is 'file'"),
+    AP_INIT_TAKE1("csrfpStoreShmSize", csrfp_storeShmSize_cmd, NULL,
+                RSRC_CONF,
+                "Size in KB of shared memory token store, default is 4096"),
+    AP_INIT_TAKE1("csrfpSnapshotFile", csrfp_snapshotFile_cmd, NULL,
+                RSRC_CONF,
+                "File the shm token store is saved to at shutdown and restored from at startup"),
+    AP_INIT_TAKE1("csrfpInjectMode", csrfp_injectMode_cmd, NULL,
+                RSRC_CONF,
+                "Where the script is injected, 'body' (default) or 'head'"),
+    AP_INIT_TAKE1("csrfpScanLimit", csrfp_scanLimit_cmd, NULL,
+                RSRC_CONF,
+                "Max bytes of a html response scanned for injection, 0 (default) for no limit"),
+    AP_INIT_TAKE1("csrfpTokenEndpoint", csrfp_tokenEndpoint_cmd, NULL,
+                RSRC_CONF,
+                "Path the script requests token cookies from, 'none' (default) to set them on pages"),
+    AP_INIT_TAKE1("csrfpJsFile", csrfp_jsFile_cmd, NULL,
+                RSRC_CONF,
+                "csrfprotector.js served from memory by the module, 'none' (default) to use jsFilePath"),
+    AP_INIT_TAKE1("csrfpRewriteForms", csrfp_rewriteForms_cmd, NULL,
+                RSRC_CONF,
+                "csrfpRewriteForms 'on'|'off', puts the token in forms and links of pages. Default is 'off'"),
+    AP_INIT_ITERATE("csrfpIgnoreExtensions", csrfp_ignoreExtensions_cmd, NULL,
+                RSRC_CONF|ACCESS_CONF,
+                "File extensions for which validation is not needed, 'none' drops the defaults"),
+    AP_INIT_ITERATE("csrfpIgnorePrefix", csrfp_ignorePrefix_cmd, NULL,
+                RSRC_CONF|ACCESS_CONF,
+                "Path prefixes for which validation is not needed"),
     { NULL }
 };
 
@@ -1568,14 +5704,48 @@ static const command_rec csrfp_directives[] =
  */
 static void csrfp_register_hooks(apr_pool_t *pool)
 {
+    csrfp_find_init();
+
     // Handler to modify output filter
     ap_register_output_filter("csrfp_out_filter", csrfp_out_filter, NULL, AP_FTYPE_RESOURCE);
 
+    // Handler to compress gzip responses again, right after csrfp_out_filter
+    ap_register_output_filter("csrfp_gzip_filter", csrfp_gzip_filter, NULL,
+                                AP_FTYPE_RESOURCE + 1);
+
+    // Handler to set token cookies, after mod_cache's CACHE_SAVE (AP_FTYPE_CONTENT_SET + 1)
+    ap_register_output_filter("csrfp_token_filter", csrfp_token_filter, NULL,
+                                AP_FTYPE_CONTENT_SET + 5);
+
     // Create hooks in the request handler, so we get called when a request arrives
     ap_hook_insert_filter(csrfp_insert_filter, NULL, NULL, APR_HOOK_REALLY_FIRST);
 
+    // Handler to get the token filter in before mod_cache answers a request
+    ap_hook_quick_handler(csrfp_quick_handler, NULL, NULL, APR_HOOK_REALLY_FIRST);
+
     // Handler to parse incoming request and validate incoming request
     ap_hook_fixups(csrfp_header_parser, NULL, NULL, APR_HOOK_LAST);
+
+    // Handler answering csrfpTokenEndpoint
+    ap_hook_handler(csrfp_token_handler, NULL, NULL, APR_HOOK_FIRST);
+
+    // Handler serving csrfpJsFile
+    ap_hook_handler(csrfp_js_handler, NULL, NULL, APR_HOOK_FIRST);
+
+    // Handler to map ETags of injected pages back for conditional requests
+    ap_hook_fixups(csrfp_etag_fixup, NULL, NULL, APR_HOOK_MIDDLE);
+
+    // Handler to send the ETag of injected pages back on 304s of handlers
+    ap_hook_insert_error_filter(csrfp_insert_error_filter, NULL, NULL, APR_HOOK_MIDDLE);
+
+    // Handler to reset the verifyGetFor scopes before the config is read
+    ap_hook_pre_config(csrfp_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+
+    // Handler to create shared resources in the parent
+    ap_hook_post_config(csrfp_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+
+    // Handler to set up SQLite in every child process
+    ap_hook_child_init(csrfp_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 
@@ -1586,10 +5756,10 @@ static void csrfp_register_hooks(apr_pool_t *pool)
 module AP_MODULE_DECLARE_DATA csrf_protector_module =
 {
     STANDARD20_MODULE_STUFF,
-    NULL,
-    NULL,
+    csrfp_dir_config_create, /* Per directory config create function */
+    csrfp_dir_config_merge, /* Per directory config merge function */
     csrfp_srv_config_create, /* Server config create function */
-    NULL,
+    csrfp_srv_config_merge, /* Server config merge function */
     csrfp_directives,       /* Any directives we may have for httpd */
     csrfp_register_hooks    /* Our hook registering function */
 };
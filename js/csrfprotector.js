@@ -20,6 +20,25 @@ var CSRFP = {
 	 * @var string array
 	 */
 	checkForUrls: [],
+	/**
+	 * Path the token cookies are requested from on every page load,
+	 * empty if the server sets them with the page, provided from server
+	 *
+	 * @var string
+	 */
+	tokenEndpoint: '',
+	/**
+	 * Token request started by _fetchToken, null if none
+	 *
+	 * @var XMLHttpRequest
+	 */
+	_tokenXhr: null,
+	/**
+	 * Whether a token was already requested synchronously, it is done once
+	 *
+	 * @var boolean
+	 */
+	_tokenSynced: false,
 	/**
 	 * Function to check if a certain url is allowed to perform the request
 	 * With or without csrf token
@@ -49,6 +68,10 @@ var CSRFP = {
 		var re = new RegExp(CSRFP.CSRFP_TOKEN +"=([^;]+)(;|$)");
 		var RegExpArray = re.exec(document.cookie);
 
+		// No cookie yet, first visit with the token fetch still pending
+		if (RegExpArray === null && CSRFP._fetchTokenSync()) {
+			RegExpArray = re.exec(document.cookie);
+		}
 		if (RegExpArray === null) {
 			return false;
 		}
@@ -140,6 +163,58 @@ var CSRFP = {
 			return result;
 		};
 	},
+	/**
+	 * Requests fresh token cookies from CSRFP.tokenEndpoint, pages
+	 * then carry no Set-Cookie and can be cached
+	 *
+	 * @param void
+	 *
+	 * @return void
+	 */
+	_fetchToken: function() {
+		if (!CSRFP.tokenEndpoint || !window.XMLHttpRequest)
+			return;
+		CSRFP._tokenXhr = CSRFP._requestToken(true);
+	},
+	/**
+	 * Requests the token cookies from CSRFP.tokenEndpoint and waits for
+	 * them, used when a token is needed before _fetchToken got its answer
+	 *
+	 * @param void
+	 *
+	 * @return boolean, true if the request was done
+	 */
+	_fetchTokenSync: function() {
+		if (!CSRFP.tokenEndpoint || !window.XMLHttpRequest
+			|| CSRFP._tokenSynced)
+			return false;
+		CSRFP._tokenSynced = true;
+		if (CSRFP._tokenXhr !== null && CSRFP._tokenXhr.readyState !== 4) {
+			CSRFP._tokenXhr.abort();
+		}
+		try {
+			CSRFP._tokenXhr = CSRFP._requestToken(false);
+		} catch (e) {
+			return false;
+		}
+		return true;
+	},
+	/**
+	 * Sends a GET to CSRFP.tokenEndpoint, with the unwrapped XHR methods
+	 * so no token is attached to it
+	 *
+	 * @param: boolean, async
+	 *
+	 * @return XMLHttpRequest
+	 */
+	_requestToken: function(async) {
+		var xhr = new XMLHttpRequest();
+		var open = xhr.old_open || xhr.open;
+		var send = xhr.old_send || xhr.send;
+		open.call(xhr, 'GET', CSRFP.tokenEndpoint, async);
+		send.call(xhr, null);
+		return xhr;
+	},
 	/**
 	 * Initialises the CSRFProtector js script
 	 *
@@ -168,6 +243,9 @@ function csrfprotector_init() {
 	// Call the init funcion
 	CSRFP._init();
 
+	// Get the token cookies, before XHR gets wrapped
+	CSRFP._fetchToken();
+
 	//==================================================================
 	// Adding csrftoken to request resulting from <form> submissions
 	// Add for each POST, while for mentioned GET request